@@ -20,103 +20,657 @@
 
 #include "qstomp.h"
 
+#include <QtCore/QAbstractEventDispatcher>
 #include <QtCore/QStringList>
-#include <QtCore/QSet>
 #include <QtCore/QTextCodec>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+#include <QtCore/QThreadStorage>
+#include <QtCore/QTimer>
+#include <QtCore/QVarLengthArray>
 #include <QtNetwork/QTcpSocket>
 
-static const QList<QByteArray> VALID_COMMANDS = QList<QByteArray>() << "ABORT" << "ACK" << "BEGIN" << "COMMIT" << "CONNECT" << "DISCONNECT"
-												<< "CONNECTED" << "MESSAGE" << "SEND" << "SUBSCRIBE" << "UNSUBSCRIBE" << "RECEIPT" << "ERROR";
+#include <string.h>
+
+#ifdef Q_OS_UNIX
+#	include <errno.h>
+#	include <limits.h>
+#	include <sys/socket.h>
+#	include <sys/uio.h>
+#endif
+#ifdef Q_OS_LINUX
+#	include <pthread.h>
+#	include <sched.h>
+#endif
+
+#if defined(Q_CC_GNU) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+#	define QSTOMP_SCAN_SSE2
+#	include <emmintrin.h>
+#	if defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#		define QSTOMP_SCAN_AVX2
+#		include <immintrin.h>
+#	endif
+#endif
+
+// Initial capacity of the receive buffer
+static const int QSTOMP_READ_CHUNK = 64 * 1024;
+// Number of distinct strings kept for header interning
+static const int QSTOMP_INTERN_LIMIT = 4096;
+// Number of released frame privates each thread keeps for reuse
+static const int QSTOMP_FRAME_POOL_LIMIT = 256;
+// Default bytes and milliseconds outgoing frames are held back for
+static const int QSTOMP_COALESCING_LIMIT = 64 * 1024;
+static const int QSTOMP_COALESCING_DELAY = 2;
+// Bodies up to this size are copied into the outbound buffer, larger ones
+// are written from the frame
+static const int QSTOMP_INLINE_BODY = 1024;
+// Send buffer requested by the high-throughput profile
+static const int QSTOMP_THROUGHPUT_SEND_BUFFER = 1024 * 1024;
+// Default limit on the size of a single received frame
+static const int QSTOMP_MAX_FRAME_SIZE = 64 * 1024 * 1024;
+// Default number of confirmed sends that may be awaiting their receipt
+static const int QSTOMP_RECEIPT_WINDOW = 256;
+// Default number of acks and milliseconds the ack batcher waits for
+static const int QSTOMP_ACK_BATCH_SIZE = 32;
+static const int QSTOMP_ACK_BATCH_DELAY = 5;
+// Defaults for transaction batching
+static const int QSTOMP_BATCH_SIZE = 100;
+static const qint64 QSTOMP_BATCH_BYTES = 1024 * 1024;
+static const int QSTOMP_BATCH_DELAY = 50;
+static const int QSTOMP_REPLAY_LIMIT = 3;
+// Default watermarks for outbound congestion
+static const qint64 QSTOMP_HIGH_WATERMARK = 1024 * 1024;
+static const qint64 QSTOMP_LOW_WATERMARK = 256 * 1024;
+// Default bounds of the queue frames are held back in
+static const qint64 QSTOMP_OUTBOUND_BYTE_LIMIT = 16 * 1024 * 1024;
+static const int QSTOMP_OUTBOUND_FRAME_LIMIT = 16384;
+// Milliseconds a blocked sender waits for the socket to make room
+static const int QSTOMP_BLOCK_TIMEOUT = 30000;
+// Frames the I/O thread may hand over before the client takes them, and
+// milliseconds it waits for queued data to leave when shutting down
+static const int QSTOMP_IO_RING_SIZE = 1024;
+static const int QSTOMP_IO_SHUTDOWN_TIMEOUT = 1000;
+// Default bound on messages queued in an ordered executor, and messages a
+// lane handles before giving other lanes a turn on the pool
+static const int QSTOMP_EXECUTOR_IN_FLIGHT = 1024;
+static const int QSTOMP_LANE_BATCH = 64;
+// Segments handed to a single gathering write
+#if defined(IOV_MAX) && IOV_MAX < 64
+static const int QSTOMP_GATHER_SEGMENTS = IOV_MAX;
+#else
+static const int QSTOMP_GATHER_SEGMENTS = 64;
+#endif
+
+enum Command {
+	CommandUnknown = 0,
+	CommandAbort,
+	CommandAck,
+	CommandBegin,
+	CommandCommit,
+	CommandConnect,
+	CommandDisconnect,
+	CommandConnected,
+	CommandMessage,
+	CommandSend,
+	CommandSubscribe,
+	CommandUnsubscribe,
+	CommandReceipt,
+	CommandError
+};
+
+struct NameEntry {
+	const char * name;
+	int length;
+};
+
+static const NameEntry COMMAND_NAMES[] = {
+	{ "", 0 }, { "ABORT", 5 }, { "ACK", 3 }, { "BEGIN", 5 }, { "COMMIT", 6 }, { "CONNECT", 7 }, { "DISCONNECT", 10 },
+	{ "CONNECTED", 9 }, { "MESSAGE", 7 }, { "SEND", 4 }, { "SUBSCRIBE", 9 }, { "UNSUBSCRIBE", 11 }, { "RECEIPT", 7 }, { "ERROR", 5 }
+};
+
+static const NameEntry HEADER_NAMES[QStompHeaderTable::KnownHeaderCount] = {
+	{ "content-length", 14 }, { "content-type", 12 }, { "content-encoding", 16 }, { "destination", 11 },
+	{ "subscription", 12 }, { "message-id", 10 }, { "receipt-id", 10 }, { "receipt", 7 }, { "message", 7 },
+	{ "transaction", 11 }, { "ack", 3 }, { "id", 2 }, { "login", 5 }, { "passcode", 8 }
+};
+
+static inline uchar foldCase(uchar c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static bool splitHeaderLine(const QByteArray &line, QByteArray &key, QByteArray &value)
+{
+	int i = line.indexOf(':');
+	if (i == -1)
+		return false;
+
+	key = line.left(i).trimmed();
+	if (key.toLower() != "passcode" && key.toLower() != "login")
+		value = line.mid(i + 1).trimmed();
+	else
+		value = line.mid(i + 1);
+
+	return true;
+}
+
+static inline bool isHeaderSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\v' || c == '\f';
+}
+
+static inline bool isCredentialKey(const char * key, int length)
+{
+	return (length == 5 && qstrnicmp(key, "login", 5) == 0) || (length == 8 && qstrnicmp(key, "passcode", 8) == 0);
+}
+
+// Hash and compare header keys case-insensitively without building
+// lowercase copies
+static inline uint foldedHash(const char * key, int length)
+{
+	uint h = 2166136261u;
+	for (int i = 0; i < length; i++)
+		h = (h ^ foldCase(key[i])) * 16777619u;
+	return h;
+}
+
+static inline bool foldedEquals(const char * a, const char * b, int length)
+{
+	for (int i = 0; i < length; i++) {
+		if (foldCase(a[i]) != foldCase(b[i]))
+			return false;
+	}
+	return true;
+}
+
+// Length and first letter select the only possible candidate, a single
+// compare confirms it
+static Command commandForName(const char * name, int length)
+{
+	Command candidate;
+	switch (length) {
+		case 3: candidate = CommandAck; break;
+		case 4: candidate = CommandSend; break;
+		case 5: candidate = (name[0] == 'A' ? CommandAbort : (name[0] == 'B' ? CommandBegin : CommandError)); break;
+		case 6: candidate = CommandCommit; break;
+		case 7: candidate = (name[0] == 'C' ? CommandConnect : (name[0] == 'M' ? CommandMessage : CommandReceipt)); break;
+		case 9: candidate = (name[0] == 'C' ? CommandConnected : CommandSubscribe); break;
+		case 10: candidate = CommandDisconnect; break;
+		case 11: candidate = CommandUnsubscribe; break;
+		default: return CommandUnknown;
+	}
+	if (qstrncmp(name, COMMAND_NAMES[candidate].name, length) != 0)
+		return CommandUnknown;
+	return candidate;
+}
+
+static int knownHeaderForName(const char * key, int length)
+{
+	int candidate;
+	switch (length) {
+		case 2: candidate = QStompHeaderTable::HeaderId; break;
+		case 3: candidate = QStompHeaderTable::HeaderAck; break;
+		case 5: candidate = QStompHeaderTable::HeaderLogin; break;
+		case 7: candidate = (foldCase(key[0]) == 'm' ? QStompHeaderTable::HeaderMessage : QStompHeaderTable::HeaderReceipt); break;
+		case 8: candidate = QStompHeaderTable::HeaderPasscode; break;
+		case 10: candidate = (foldCase(key[0]) == 'm' ? QStompHeaderTable::HeaderMessageId : QStompHeaderTable::HeaderReceiptId); break;
+		case 11: candidate = (foldCase(key[0]) == 'd' ? QStompHeaderTable::HeaderDestination : QStompHeaderTable::HeaderTransaction); break;
+		case 12: candidate = (foldCase(key[0]) == 's' ? QStompHeaderTable::HeaderSubscription : QStompHeaderTable::HeaderContentType); break;
+		case 14: candidate = QStompHeaderTable::HeaderContentLength; break;
+		case 16: candidate = QStompHeaderTable::HeaderContentEncoding; break;
+		default: return -1;
+	}
+	if (!foldedEquals(key, HEADER_NAMES[candidate].name, length))
+		return -1;
+	return candidate;
+}
+
+// Delimiter scanning: find the first byte in [from, to) that is either a or
+// b, or -1. Pass the same byte twice to look for a single one.
+typedef int (*ScanFunction)(const char * data, int from, int to, char a, char b);
+
+static int scanScalar(const char * data, int from, int to, char a, char b)
+{
+	if (from >= to)
+		return -1;
+	if (a == b) {
+		const void * hit = memchr(data + from, a, to - from);
+		return hit == NULL ? -1 : int(static_cast<const char *>(hit) - data);
+	}
+	for (int i = from; i < to; i++) {
+		if (data[i] == a || data[i] == b)
+			return i;
+	}
+	return -1;
+}
+
+#ifdef QSTOMP_SCAN_SSE2
+static int scanSse2(const char * data, int from, int to, char a, char b)
+{
+	const __m128i va = _mm_set1_epi8(a);
+	const __m128i vb = _mm_set1_epi8(b);
+	int i = from;
+	for (; i + 16 <= to; i += 16) {
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+		int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chunk, va), _mm_cmpeq_epi8(chunk, vb)));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return scanScalar(data, i, to, a, b);
+}
+#endif
+
+#ifdef QSTOMP_SCAN_AVX2
+__attribute__((target("avx2")))
+static int scanAvx2(const char * data, int from, int to, char a, char b)
+{
+	const __m256i va = _mm256_set1_epi8(a);
+	const __m256i vb = _mm256_set1_epi8(b);
+	int i = from;
+	for (; i + 32 <= to; i += 32) {
+		__m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+		uint mask = uint(_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(chunk, va), _mm256_cmpeq_epi8(chunk, vb))));
+		if (mask != 0)
+			return i + __builtin_ctz(mask);
+	}
+	return scanSse2(data, i, to, a, b);
+}
+#endif
+
+static ScanFunction selectScanner()
+{
+#ifdef QSTOMP_SCAN_AVX2
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return scanAvx2;
+#endif
+#ifdef QSTOMP_SCAN_SSE2
+	return scanSse2;
+#else
+	return scanScalar;
+#endif
+}
+
+static inline int scanFor(const char * data, int from, int to, char a, char b)
+{
+	static const ScanFunction scan = selectScanner();
+	return scan(data, from, to, a, b);
+}
+
+static inline int scanFor(const char * data, int from, int to, char c)
+{
+	return scanFor(data, from, to, c, c);
+}
+
+static bool headerLineSpan(const char * data, int start, int end, QStompHeaderSpan &span)
+{
+	int colon = start;
+	while (colon < end && data[colon] != ':')
+		colon++;
+	if (colon == end)
+		return false;
+
+	int keyStart = start;
+	int keyEnd = colon;
+	while (keyStart < keyEnd && isHeaderSpace(data[keyStart]))
+		keyStart++;
+	while (keyEnd > keyStart && isHeaderSpace(data[keyEnd - 1]))
+		keyEnd--;
+
+	int valueStart = colon + 1;
+	int valueEnd = end;
+	if (!isCredentialKey(data + keyStart, keyEnd - keyStart)) {
+		while (valueStart < valueEnd && isHeaderSpace(data[valueStart]))
+			valueStart++;
+		while (valueEnd > valueStart && isHeaderSpace(data[valueEnd - 1]))
+			valueEnd--;
+	}
+
+	span.keyPos = keyStart;
+	span.keyLength = keyEnd - keyStart;
+	span.valuePos = valueStart;
+	span.valueLength = valueEnd - valueStart;
+	return true;
+}
+
+static QStompResponseFrame::ResponseType responseTypeForCommand(Command cmd)
+{
+	switch (cmd) {
+		case CommandConnected:
+			return QStompResponseFrame::ResponseConnected;
+		case CommandMessage:
+			return QStompResponseFrame::ResponseMessage;
+		case CommandReceipt:
+			return QStompResponseFrame::ResponseReceipt;
+		case CommandError:
+			return QStompResponseFrame::ResponseError;
+		default:
+			return QStompResponseFrame::ResponseInvalid;
+	}
+}
+
+static QStompRequestFrame::RequestType requestTypeForCommand(Command cmd)
+{
+	switch (cmd) {
+		case CommandConnect:
+			return QStompRequestFrame::RequestConnect;
+		case CommandSend:
+			return QStompRequestFrame::RequestSend;
+		case CommandSubscribe:
+			return QStompRequestFrame::RequestSubscribe;
+		case CommandUnsubscribe:
+			return QStompRequestFrame::RequestUnsubscribe;
+		case CommandBegin:
+			return QStompRequestFrame::RequestBegin;
+		case CommandCommit:
+			return QStompRequestFrame::RequestCommit;
+		case CommandAbort:
+			return QStompRequestFrame::RequestAbort;
+		case CommandAck:
+			return QStompRequestFrame::RequestAck;
+		case CommandDisconnect:
+			return QStompRequestFrame::RequestDisconnect;
+		default:
+			return QStompRequestFrame::RequestInvalid;
+	}
+}
+
+static Command commandForResponseType(QStompResponseFrame::ResponseType type)
+{
+	switch (type) {
+		case QStompResponseFrame::ResponseConnected:
+			return CommandConnected;
+		case QStompResponseFrame::ResponseMessage:
+			return CommandMessage;
+		case QStompResponseFrame::ResponseReceipt:
+			return CommandReceipt;
+		case QStompResponseFrame::ResponseError:
+			return CommandError;
+		default:
+			return CommandUnknown;
+	}
+}
+
+static Command commandForRequestType(QStompRequestFrame::RequestType type)
+{
+	switch (type) {
+		case QStompRequestFrame::RequestConnect:
+			return CommandConnect;
+		case QStompRequestFrame::RequestSend:
+			return CommandSend;
+		case QStompRequestFrame::RequestSubscribe:
+			return CommandSubscribe;
+		case QStompRequestFrame::RequestUnsubscribe:
+			return CommandUnsubscribe;
+		case QStompRequestFrame::RequestBegin:
+			return CommandBegin;
+		case QStompRequestFrame::RequestCommit:
+			return CommandCommit;
+		case QStompRequestFrame::RequestAbort:
+			return CommandAbort;
+		case QStompRequestFrame::RequestAck:
+			return CommandAck;
+		case QStompRequestFrame::RequestDisconnect:
+			return CommandDisconnect;
+		default:
+			return CommandUnknown;
+	}
+}
+
+static const QTextCodec * defaultTextCodec()
+{
+	// Codecs live until the application exits, so the lookup (and the
+	// registry lock it takes) only has to happen once
+	static const QTextCodec * const codec = QTextCodec::codecForName("utf-8");
+	return codec;
+}
+
+static const size_t QSTOMP_FRAME_BLOCK = sizeof(QStompResponseFramePrivate) > sizeof(QStompRequestFramePrivate) ?
+	sizeof(QStompResponseFramePrivate) : sizeof(QStompRequestFramePrivate);
+
+class QStompFramePool;
+
+// Precedes every pooled frame private and remembers the pool it came from
+struct QStompFrameBlock
+{
+	QStompFramePool * home;
+	// Links blocks handed back by other threads
+	QStompFrameBlock * next;
+};
+
+// Free list of one thread. Frames often die on another thread than the one
+// that created them (I/O thread, producers, executor lanes); their blocks
+// go back to the pool they came from through a lock-free stack, which the
+// owning thread takes over once its own list runs empty.
+class QStompFramePool
+{
+public:
+	QStompFramePool() : m_count(0) {}
+
+	inline QStompFrameBlock * take()
+	{
+		if (this->m_count == 0 && qstompLoadAcquire(this->m_remote) != NULL)
+			this->collectRemote();
+		if (this->m_count > 0)
+			return this->m_blocks[--this->m_count];
+		QStompFrameBlock * block = static_cast<QStompFrameBlock *>(::operator new(sizeof(QStompFrameBlock) + QSTOMP_FRAME_BLOCK));
+		block->home = this;
+		return block;
+	}
+
+	// Owning thread only
+	inline void give(QStompFrameBlock * block)
+	{
+		if (this->m_count < QSTOMP_FRAME_POOL_LIMIT)
+			this->m_blocks[this->m_count++] = block;
+		else
+			::operator delete(block);
+	}
+
+	// Any other thread
+	void giveRemote(QStompFrameBlock * block)
+	{
+		QStompFrameBlock * top;
+		do {
+			top = qstompLoadAcquire(this->m_remote);
+			if (top == retiredMark()) {
+				::operator delete(block);
+				return;
+			}
+			block->next = top;
+		} while (!this->m_remote.testAndSetRelease(top, block));
+	}
+
+	// Called when the owning thread exits. Blocks still alive elsewhere point
+	// at the pool, so it is never deleted; once retired it frees whatever is
+	// handed back instead of keeping it.
+	void retire()
+	{
+		for (int i = 0; i < this->m_count; i++)
+			::operator delete(this->m_blocks[i]);
+		this->m_count = 0;
+		QStompFrameBlock * block = this->m_remote.fetchAndStoreAcquire(retiredMark());
+		while (block != NULL) {
+			QStompFrameBlock * next = block->next;
+			::operator delete(block);
+			block = next;
+		}
+	}
+
+private:
+	void collectRemote()
+	{
+		QStompFrameBlock * block = this->m_remote.fetchAndStoreAcquire(0);
+		while (block != NULL) {
+			QStompFrameBlock * next = block->next;
+			this->give(block);
+			block = next;
+		}
+	}
+
+	static QStompFrameBlock * retiredMark()
+	{
+		static QStompFrameBlock mark;
+		return &mark;
+	}
+
+	QStompFrameBlock * m_blocks[QSTOMP_FRAME_POOL_LIMIT];
+	int m_count;
+	QAtomicPointer<QStompFrameBlock> m_remote;
+};
+
+// Owned by the thread storage, retires the pool instead of deleting it
+class QStompFramePoolRef
+{
+public:
+	QStompFramePoolRef() : pool(new QStompFramePool) {}
+	~QStompFramePoolRef() { pool->retire(); }
+
+	QStompFramePool * const pool;
+};
+
+static QThreadStorage<QStompFramePoolRef *> framePools;
+
+static QStompFramePool * localFramePool()
+{
+	if (!framePools.hasLocalData())
+		framePools.setLocalData(new QStompFramePoolRef);
+	return framePools.localData()->pool;
+}
+
+void * QStompFramePrivate::operator new(size_t size)
+{
+	if (size > QSTOMP_FRAME_BLOCK)
+		return ::operator new(size);
+	return localFramePool()->take() + 1;
+}
+
+void QStompFramePrivate::operator delete(void * ptr, size_t size)
+{
+	if (ptr == NULL)
+		return;
+	if (size > QSTOMP_FRAME_BLOCK) {
+		::operator delete(ptr);
+		return;
+	}
+	QStompFrameBlock * block = static_cast<QStompFrameBlock *>(ptr) - 1;
+	if (framePools.hasLocalData() && framePools.localData()->pool == block->home)
+		block->home->give(block);
+	else
+		block->home->giveRemote(block);
+}
 
 QStompFrame::QStompFrame(QStompFramePrivate * d) : pd_ptr(d)
 {
+	d->ref.ref();
+	d->m_headerPos = 0;
+	d->m_headerLength = 0;
+	d->m_headerViews = false;
 	d->m_valid = true;
-	d->m_textCodec = QTextCodec::codecForName("utf-8");
+	d->m_textCodec = defaultTextCodec();
+}
+
+QStompFrame::QStompFrame(const QStompFrame &other) : pd_ptr(other.pd_ptr)
+{
+	this->pd_ptr->ref.ref();
 }
 
-QStompFrame::QStompFrame(const QStompFrame &other, QStompFramePrivate * d) : pd_ptr(d)
+#ifdef Q_COMPILER_RVALUE_REFS
+QStompFrame::QStompFrame(QStompFrame &&other) : pd_ptr(other.pd_ptr)
 {
-	d->m_valid = other.pd_ptr->m_valid;
-	d->m_header = other.pd_ptr->m_header;
-	d->m_body = other.pd_ptr->m_body;
-	d->m_textCodec = other.pd_ptr->m_textCodec;
+	other.pd_ptr = NULL;
 }
+#endif
 
 QStompFrame::~QStompFrame()
 {
-	delete this->pd_ptr;
+	if (this->pd_ptr != NULL && !this->pd_ptr->ref.deref())
+		delete this->pd_ptr;
 }
 
 QStompFrame & QStompFrame::operator=(const QStompFrame &other)
 {
-	P_D(QStompFrame);
-	d->m_valid = other.pd_ptr->m_valid;
-	d->m_header = other.pd_ptr->m_header;
-	d->m_body = other.pd_ptr->m_body;
-	d->m_textCodec = other.pd_ptr->m_textCodec;
+	// Only the part common to all frames is taken over, this frame keeps
+	// its own type
+	if (this->pd_ptr != other.pd_ptr) {
+		other.pd_ptr->ensureHeader();
+		P_D(QStompFrame);
+		d->copyFrameFrom(*other.pd_ptr);
+	}
 	return *this;
 }
 
+void QStompFrame::share(const QStompFrame &other)
+{
+	other.pd_ptr->ref.ref();
+	if (!this->pd_ptr->ref.deref())
+		delete this->pd_ptr;
+	this->pd_ptr = other.pd_ptr;
+}
+
+void QStompFrame::detach()
+{
+	if (qstompLoadAcquire(this->pd_ptr->ref) == 1)
+		return;
+
+	// Tokenize before copying so the clone does not race with another
+	// reader of the shared private
+	this->pd_ptr->ensureHeader();
+	QStompFramePrivate * x = this->pd_ptr->clone();
+	x->ref.ref();
+	if (!this->pd_ptr->ref.deref())
+		delete this->pd_ptr;
+	this->pd_ptr = x;
+}
+
 void QStompFrame::setHeaderValue(const QByteArray &key, const QByteArray &value)
 {
 	P_D(QStompFrame);
-	QByteArray lowercaseKey = key.toLower();
-	QStompHeaderList::Iterator it = d->m_header.begin();
-	while (it != d->m_header.end()) {
-		if ((*it).first.toLower() == lowercaseKey) {
-			(*it).second = value;
-			return;
-		}
-		++it;
-	}
-	this->addHeaderValue(key, value);
+	d->ensureHeader();
+	int i = d->m_header.indexOf(key);
+	if (i != -1)
+		d->m_header.setValueAt(i, value);
+	else
+		d->m_header.append(key, value);
 }
 
 void QStompFrame::setHeaderValues(const QStompHeaderList &values)
 {
 	P_D(QStompFrame);
-	d->m_header = values;
+	d->ensureHeader();
+	d->m_header.setList(values);
 }
 
 void QStompFrame::addHeaderValue(const QByteArray &key, const QByteArray &value)
 {
 	P_D(QStompFrame);
-	d->m_header.append(qMakePair(key, value));
+	d->ensureHeader();
+	d->m_header.append(key, value);
 }
 
 QStompHeaderList QStompFrame::header() const
 {
 	const P_D(QStompFrame);
-	return d->m_header;
+	d->ensureHeader();
+	return d->m_header.toList();
 }
 
 bool QStompFrame::headerHasKey(const QByteArray &key) const
 {
 	const P_D(QStompFrame);
-	QByteArray lowercaseKey = key.toLower();
-	QStompHeaderList::ConstIterator it = d->m_header.constBegin();
-	while (it != d->m_header.constEnd()) {
-		if ((*it).first.toLower() == lowercaseKey)
-			return true;
-		++it;
-	}
-	return false;
+	d->ensureHeader();
+	return d->m_header.indexOf(key) != -1;
 }
 
 QList<QByteArray> QStompFrame::headerKeys() const
 {
 	const P_D(QStompFrame);
+	d->ensureHeader();
 	QList<QByteArray> keyList;
-	QSet<QByteArray> seenKeys;
-	QStompHeaderList::ConstIterator it = d->m_header.constBegin();
-	while (it != d->m_header.constEnd()) {
-		QByteArray key = (*it).first;
-		QByteArray lowercaseKey = key.toLower();
-		if (!seenKeys.contains(lowercaseKey)) {
-			keyList.append(key);
-			seenKeys.insert(lowercaseKey);
-		}
-		++it;
+	for (int i = 0; i < d->m_header.size(); i++) {
+		// Only report the first spelling of every key
+		if (d->m_header.indexOf(d->m_header.keyData(i), d->m_header.keyLength(i)) == i)
+			keyList.append(d->m_header.keyAt(i));
 	}
 	return keyList;
 }
@@ -124,81 +678,71 @@ QList<QByteArray> QStompFrame::headerKeys() const
 QByteArray QStompFrame::headerValue(const QByteArray &key) const
 {
 	const P_D(QStompFrame);
-	QByteArray lowercaseKey = key.toLower();
-	QStompHeaderList::ConstIterator it = d->m_header.constBegin();
-	while (it != d->m_header.constEnd()) {
-		if ((*it).first.toLower() == lowercaseKey)
-			return (*it).second;
-		++it;
-	}
-	return QByteArray();
+	d->ensureHeader();
+	int i = d->m_header.indexOf(key);
+	if (i == -1)
+		return QByteArray();
+	return d->m_header.valueAt(i);
 }
 
 QList<QByteArray> QStompFrame::allHeaderValues(const QByteArray &key) const
 {
 	const P_D(QStompFrame);
+	d->ensureHeader();
 	QList<QByteArray> valueList;
-	QByteArray lowercaseKey = key.toLower();
-	QStompHeaderList::ConstIterator it = d->m_header.constBegin();
-	while (it != d->m_header.constEnd()) {
-		if ((*it).first.toLower() == lowercaseKey)
-			valueList.append((*it).second);
-		++it;
-	}
+	int i = -1;
+	while ((i = d->m_header.indexOf(key, i + 1)) != -1)
+		valueList.append(d->m_header.valueAt(i));
 	return valueList;
 }
 
 void QStompFrame::removeHeaderValue(const QByteArray &key)
 {
 	P_D(QStompFrame);
-	QByteArray lowercaseKey = key.toLower();
-	QStompHeaderList::Iterator it = d->m_header.begin();
-	while (it != d->m_header.end()) {
-		if ((*it).first.toLower() == lowercaseKey) {
-			d->m_header.erase(it);
-			return;
-		}
-		++it;
-	}
+	d->ensureHeader();
+	int i = d->m_header.indexOf(key);
+	if (i != -1)
+		d->m_header.removeAt(i);
 }
 
 void QStompFrame::removeAllHeaderValues(const QByteArray &key)
 {
 	P_D(QStompFrame);
-	QByteArray lowercaseKey = key.toLower();
-	QStompHeaderList::Iterator it = d->m_header.begin();
-	while (it != d->m_header.end()) {
-		if ((*it).first.toLower() == lowercaseKey) {
-			d->m_header.erase(it);
-			continue;
-		}
-		++it;
-	}
+	d->ensureHeader();
+	int i = 0;
+	while ((i = d->m_header.indexOf(key, i)) != -1)
+		d->m_header.removeAt(i);
 }
 
 bool QStompFrame::hasContentLength() const
 {
-	return this->headerHasKey("content-length");
+	const P_D(QStompFrame);
+	return d->hasHeader(QStompHeaderTable::HeaderContentLength);
 }
 
 uint QStompFrame::contentLength() const
 {
-	return this->headerValue("content-length").toUInt();
+	const P_D(QStompFrame);
+	d->ensureHeader();
+	return d->m_header.contentLength();
 }
 
 void QStompFrame::setContentLength(uint len)
 {
-	this->setHeaderValue("content-length", QByteArray::number(len));
+	P_D(QStompFrame);
+	d->setHeaderValue(QStompHeaderTable::HeaderContentLength, QByteArray::number(len));
 }
 
 bool QStompFrame::hasContentType() const
 {
-	return this->headerHasKey("content-type");
+	const P_D(QStompFrame);
+	return d->hasHeader(QStompHeaderTable::HeaderContentType);
 }
 
 QByteArray QStompFrame::contentType() const
 {
-	QByteArray type = this->headerValue("content-type");
+	const P_D(QStompFrame);
+	QByteArray type = d->headerValue(QStompHeaderTable::HeaderContentType);
 	if (type.isEmpty())
 		return QByteArray();
 
@@ -211,30 +755,36 @@ QByteArray QStompFrame::contentType() const
 
 void QStompFrame::setContentType(const QByteArray &type)
 {
-	this->setHeaderValue("content-type", type);
+	P_D(QStompFrame);
+	d->setHeaderValue(QStompHeaderTable::HeaderContentType, type);
 }
 
 bool QStompFrame::hasContentEncoding() const
 {
-	return this->headerHasKey("content-length");
+	const P_D(QStompFrame);
+	return d->hasHeader(QStompHeaderTable::HeaderContentEncoding);
 }
 
 QByteArray QStompFrame::contentEncoding() const
 {
-	return this->headerValue("content-encoding");
+	const P_D(QStompFrame);
+	return d->headerValue(QStompHeaderTable::HeaderContentEncoding);
 }
 
 void QStompFrame::setContentEncoding(const QByteArray &name)
 {
 	P_D(QStompFrame);
-	this->setHeaderValue("content-encoding", name);
-	d->m_textCodec = QTextCodec::codecForName(name);
+	d->setHeaderValue(QStompHeaderTable::HeaderContentEncoding, name);
+	if (name.size() == 5 && foldedEquals(name.constData(), "utf-8", 5))
+		d->m_textCodec = defaultTextCodec();
+	else
+		d->m_textCodec = QTextCodec::codecForName(name);
 }
 
 void QStompFrame::setContentEncoding(const QTextCodec * codec)
 {
 	P_D(QStompFrame);
-	this->setHeaderValue("content-encoding", codec->name());
+	d->setHeaderValue(QStompHeaderTable::HeaderContentEncoding, codec->name());
 	d->m_textCodec = codec;
 }
 
@@ -244,19 +794,10 @@ QByteArray QStompFrame::toByteArray() const
 	if (!this->isValid())
 		return QByteArray("");
 
-	QByteArray ret = QByteArray("");
-
-	QStompHeaderList::ConstIterator it = d->m_header.constBegin();
-	while (it != d->m_header.constEnd()) {
-		QByteArray key = (*it).first;
-		if (key.toLower() != "login" && key.toLower() != "passcode")
-			ret += key + ": " + (*it).second + "\n";
-		else
-			ret += key + ":" + (*it).second + "\n";
-		++it;
-	}
-	ret.append('\n');
-	return ret + d->m_body;
+	QByteArray ret;
+	d->writeHead(ret, NULL, 0);
+	ret.append(d->m_body);
+	return ret;
 }
 
 bool QStompFrame::isValid() const
@@ -267,16 +808,11 @@ bool QStompFrame::isValid() const
 
 bool QStompFrame::parseHeaderLine(const QByteArray &line, int)
 {
-	int i = line.indexOf(':');
-	if (i == -1)
+	QByteArray key, value;
+	if (!splitHeaderLine(line, key, value))
 		return false;
 
-	QByteArray key = line.left(i).trimmed();
-	if (key.toLower() != "passcode" && key.toLower() != "login")
-		this->addHeaderValue(key, line.mid(i + 1).trimmed());
-	else
-		this->addHeaderValue(key, line.mid(i + 1));
-
+	this->addHeaderValue(key, value);
 	return true;
 }
 
@@ -342,12 +878,18 @@ QStompResponseFrame::QStompResponseFrame() : QStompFrame(new QStompResponseFrame
 	this->setType(QStompResponseFrame::ResponseInvalid);
 }
 
-QStompResponseFrame::QStompResponseFrame(const QStompResponseFrame &other) : QStompFrame(other, new QStompResponseFramePrivate)
+QStompResponseFrame::QStompResponseFrame(const QStompResponseFrame &other) : QStompFrame(other)
 {
-	P_D(QStompResponseFrame);
-	d->m_type = other.pd_func()->m_type;
 }
 
+#ifdef Q_COMPILER_RVALUE_REFS
+QStompResponseFrame::QStompResponseFrame(QStompResponseFrame &&other) : QStompFrame(static_cast<QStompFrame &&>(other))
+{
+	// Leave the source as a valid, empty frame
+	other.pd_ptr = QStompResponseFramePrivate::sharedNull();
+}
+#endif
+
 QStompResponseFrame::QStompResponseFrame(const QByteArray &frame) : QStompFrame(new QStompResponseFramePrivate)
 {
 	this->setValid(this->parse(frame));
@@ -360,9 +902,7 @@ QStompResponseFrame::QStompResponseFrame(QStompResponseFrame::ResponseType type)
 
 QStompResponseFrame & QStompResponseFrame::operator=(const QStompResponseFrame &other)
 {
-	QStompFrame::operator=(other);
-	P_D(QStompResponseFrame);
-	d->m_type = other.pd_func()->m_type;
+	this->share(other);
 	return *this;
 }
 
@@ -385,18 +925,8 @@ bool QStompResponseFrame::parseHeaderLine(const QByteArray &line, int number)
 	if (number != 0)
 		return QStompFrame::parseHeaderLine(line, number);
 
-	if (line == "CONNECTED")
-		d->m_type = QStompResponseFrame::ResponseConnected;
-	else if (line == "MESSAGE")
-		d->m_type = QStompResponseFrame::ResponseMessage;
-	else if (line == "RECEIPT")
-		d->m_type = QStompResponseFrame::ResponseReceipt;
-	else if (line == "ERROR")
-		d->m_type = QStompResponseFrame::ResponseError;
-	else
-		return false;
-
-	return true;
+	d->m_type = responseTypeForCommand(commandForName(line.constData(), line.size()));
+	return d->m_type != QStompResponseFrame::ResponseInvalid;
 }
 
 QByteArray QStompResponseFrame::toByteArray() const
@@ -405,95 +935,104 @@ QByteArray QStompResponseFrame::toByteArray() const
 	if (!this->isValid())
 		return QByteArray("");
 
+	Command cmd = commandForResponseType(d->m_type);
+	if (cmd == CommandUnknown)
+		return QByteArray("");
+
 	QByteArray ret;
-	switch (d->m_type) {
-		case QStompResponseFrame::ResponseInvalid:
-			return QByteArray("");
-		case QStompResponseFrame::ResponseConnected:
-			ret = "CONNECTED\n"; break;
-		case QStompResponseFrame::ResponseMessage:
-			ret = "MESSAGE\n"; break;
-		case QStompResponseFrame::ResponseReceipt:
-			ret = "RECEIPT\n"; break;
-		case QStompResponseFrame::ResponseError:
-			ret = "ERROR\n"; break;
-	}
-	return ret + QStompFrame::toByteArray();
+	d->writeHead(ret, COMMAND_NAMES[cmd].name, COMMAND_NAMES[cmd].length);
+	ret.append(d->m_body);
+	return ret;
 }
 
 bool QStompResponseFrame::hasDestination() const
 {
-	return this->headerHasKey("destination");
+	const P_D(QStompResponseFrame);
+	return d->hasHeader(QStompHeaderTable::HeaderDestination);
 }
 
 QByteArray QStompResponseFrame::destination() const
 {
-	return this->headerValue("destination");
+	const P_D(QStompResponseFrame);
+	return d->headerValue(QStompHeaderTable::HeaderDestination);
 }
 
 void QStompResponseFrame::setDestination(const QByteArray &value)
 {
-	this->setHeaderValue("destination", value);
+	P_D(QStompResponseFrame);
+	d->setHeaderValue(QStompHeaderTable::HeaderDestination, value);
 }
 
 bool QStompResponseFrame::hasSubscriptionId() const
 {
-	return this->headerHasKey("subscription");
+	const P_D(QStompResponseFrame);
+	return d->hasHeader(QStompHeaderTable::HeaderSubscription);
 }
 
 QByteArray QStompResponseFrame::subscriptionId() const
 {
-	return this->headerValue("subscription");
+	const P_D(QStompResponseFrame);
+	return d->headerValue(QStompHeaderTable::HeaderSubscription);
 }
 
 void QStompResponseFrame::setSubscriptionId(const QByteArray &value)
 {
-	this->setHeaderValue("subscription", value);
+	P_D(QStompResponseFrame);
+	d->setHeaderValue(QStompHeaderTable::HeaderSubscription, value);
 }
 
 bool QStompResponseFrame::hasMessageId() const
 {
-	return this->headerHasKey("message-id");
+	const P_D(QStompResponseFrame);
+	return d->hasHeader(QStompHeaderTable::HeaderMessageId);
 }
 
 QByteArray QStompResponseFrame::messageId() const
 {
-	return this->headerValue("message-id");
+	const P_D(QStompResponseFrame);
+	return d->headerValue(QStompHeaderTable::HeaderMessageId);
 }
 
 void QStompResponseFrame::setMessageId(const QByteArray &value)
 {
-	this->setHeaderValue("message-id", value);
+	P_D(QStompResponseFrame);
+	d->setHeaderValue(QStompHeaderTable::HeaderMessageId, value);
 }
 
 bool QStompResponseFrame::hasReceiptId() const
 {
-	return this->headerHasKey("receipt-id");
+	const P_D(QStompResponseFrame);
+	return d->hasHeader(QStompHeaderTable::HeaderReceiptId);
 }
 
 QByteArray QStompResponseFrame::receiptId() const
 {
-	return this->headerValue("receipt-id");
+	const P_D(QStompResponseFrame);
+	return d->headerValue(QStompHeaderTable::HeaderReceiptId);
 }
 
 void QStompResponseFrame::setReceiptId(const QByteArray &value)
 {
-	this->setHeaderValue("receipt-id", value);
+	P_D(QStompResponseFrame);
+	d->setHeaderValue(QStompHeaderTable::HeaderReceiptId, value);
 }
 
 bool QStompResponseFrame::hasMessage() const
 {
-	return this->headerHasKey("message");
+	const P_D(QStompResponseFrame);
+	return d->hasHeader(QStompHeaderTable::HeaderMessage);
 }
 
 QByteArray QStompResponseFrame::message() const
 {
-	return this->headerValue("message");
+	const P_D(QStompResponseFrame);
+	return d->headerValue(QStompHeaderTable::HeaderMessage);
 }
 
 void QStompResponseFrame::setMessage(const QByteArray &value)
 {
-	this->setHeaderValue("message", value);
+	P_D(QStompResponseFrame);
+	d->setHeaderValue(QStompHeaderTable::HeaderMessage, value);
 }
 
 
@@ -502,12 +1041,18 @@ QStompRequestFrame::QStompRequestFrame() : QStompFrame(new QStompRequestFramePri
 	this->setType(QStompRequestFrame::RequestInvalid);
 }
 
-QStompRequestFrame::QStompRequestFrame(const QStompRequestFrame &other) : QStompFrame(other, new QStompRequestFramePrivate)
+QStompRequestFrame::QStompRequestFrame(const QStompRequestFrame &other) : QStompFrame(other)
 {
-	P_D(QStompRequestFrame);
-	d->m_type = other.pd_func()->m_type;
 }
 
+#ifdef Q_COMPILER_RVALUE_REFS
+QStompRequestFrame::QStompRequestFrame(QStompRequestFrame &&other) : QStompFrame(static_cast<QStompFrame &&>(other))
+{
+	// Leave the source as a valid, empty frame
+	other.pd_ptr = QStompRequestFramePrivate::sharedNull();
+}
+#endif
+
 QStompRequestFrame::QStompRequestFrame(const QByteArray &frame) : QStompFrame(new QStompRequestFramePrivate)
 {
 	this->setValid(this->parse(frame));
@@ -520,9 +1065,7 @@ QStompRequestFrame::QStompRequestFrame(QStompRequestFrame::RequestType type) : Q
 
 QStompRequestFrame & QStompRequestFrame::operator=(const QStompRequestFrame &other)
 {
-	QStompFrame::operator=(other);
-	P_D(QStompRequestFrame);
-	d->m_type = other.pd_func()->m_type;
+	this->share(other);
 	return *this;
 }
 
@@ -545,28 +1088,8 @@ bool QStompRequestFrame::parseHeaderLine(const QByteArray &line, int number)
 	if (number != 0)
 		return QStompFrame::parseHeaderLine(line, number);
 
-	if (line == "CONNECT")
-		d->m_type = QStompRequestFrame::RequestConnect;
-	else if (line == "SEND")
-		d->m_type = QStompRequestFrame::RequestSend;
-	else if (line == "SUBSCRIBE")
-		d->m_type = QStompRequestFrame::RequestSubscribe;
-	else if (line == "UNSUBSCRIBE")
-		d->m_type = QStompRequestFrame::RequestUnsubscribe;
-	else if (line == "BEGIN")
-		d->m_type = QStompRequestFrame::RequestBegin;
-	else if (line == "COMMIT")
-		d->m_type = QStompRequestFrame::RequestCommit;
-	else if (line == "ABORT")
-		d->m_type = QStompRequestFrame::RequestAbort;
-	else if (line == "ACK")
-		d->m_type = QStompRequestFrame::RequestAck;
-	else if (line == "DISCONNECT")
-		d->m_type = QStompRequestFrame::RequestDisconnect;
-	else
-		return false;
-
-	return true;
+	d->m_type = requestTypeForCommand(commandForName(line.constData(), line.size()));
+	return d->m_type != QStompRequestFrame::RequestInvalid;
 }
 
 QByteArray QStompRequestFrame::toByteArray() const
@@ -575,122 +1098,124 @@ QByteArray QStompRequestFrame::toByteArray() const
 	if (!this->isValid())
 		return QByteArray("");
 
+	Command cmd = commandForRequestType(d->m_type);
+	if (cmd == CommandUnknown)
+		return QByteArray("");
+
 	QByteArray ret;
-	switch (d->m_type) {
-		case QStompRequestFrame::RequestInvalid:
-			return QByteArray("");
-		case QStompRequestFrame::RequestConnect:
-			ret = "CONNECT\n"; break;
-		case QStompRequestFrame::RequestSend:
-			ret = "SEND\n"; break;
-		case QStompRequestFrame::RequestSubscribe:
-			ret = "SUBSCRIBE\n"; break;
-		case QStompRequestFrame::RequestUnsubscribe:
-			ret = "UNSUBSCRIBE\n"; break;
-		case QStompRequestFrame::RequestBegin:
-			ret = "BEGIN\n"; break;
-		case QStompRequestFrame::RequestCommit:
-			ret = "COMMIT\n"; break;
-		case QStompRequestFrame::RequestAbort:
-			ret = "ABORT\n"; break;
-		case QStompRequestFrame::RequestAck:
-			ret = "ACK\n"; break;
-		case QStompRequestFrame::RequestDisconnect:
-			ret = "DISCONNECT\n"; break;
-	}
-	return ret + QStompFrame::toByteArray();
+	d->writeHead(ret, COMMAND_NAMES[cmd].name, COMMAND_NAMES[cmd].length);
+	ret.append(d->m_body);
+	return ret;
 }
 
 bool QStompRequestFrame::hasDestination() const
 {
-	return this->headerHasKey("destination");
+	const P_D(QStompRequestFrame);
+	return d->hasHeader(QStompHeaderTable::HeaderDestination);
 }
 
 QByteArray QStompRequestFrame::destination() const
 {
-	return this->headerValue("destination");
+	const P_D(QStompRequestFrame);
+	return d->headerValue(QStompHeaderTable::HeaderDestination);
 }
 
 void QStompRequestFrame::setDestination(const QByteArray &value)
 {
-	this->setHeaderValue("destination", value);
+	P_D(QStompRequestFrame);
+	d->setHeaderValue(QStompHeaderTable::HeaderDestination, value);
 }
 
 bool QStompRequestFrame::hasTransactionId() const
 {
-	return this->headerHasKey("transaction");
+	const P_D(QStompRequestFrame);
+	return d->hasHeader(QStompHeaderTable::HeaderTransaction);
 }
 
 QByteArray QStompRequestFrame::transactionId() const
 {
-	return this->headerValue("transaction");
+	const P_D(QStompRequestFrame);
+	return d->headerValue(QStompHeaderTable::HeaderTransaction);
 }
 
 void QStompRequestFrame::setTransactionId(const QByteArray &value)
 {
-	this->setHeaderValue("transaction", value);
+	P_D(QStompRequestFrame);
+	d->setHeaderValue(QStompHeaderTable::HeaderTransaction, value);
 }
 
 bool QStompRequestFrame::hasMessageId() const
 {
-	return this->headerHasKey("message-id");
+	const P_D(QStompRequestFrame);
+	return d->hasHeader(QStompHeaderTable::HeaderMessageId);
 }
 
 QByteArray QStompRequestFrame::messageId() const
 {
-	return this->headerValue("message-id");
+	const P_D(QStompRequestFrame);
+	return d->headerValue(QStompHeaderTable::HeaderMessageId);
 }
 
 void QStompRequestFrame::setMessageId(const QByteArray &value)
 {
-	this->setHeaderValue("message-id", value);
+	P_D(QStompRequestFrame);
+	d->setHeaderValue(QStompHeaderTable::HeaderMessageId, value);
 }
 
 bool QStompRequestFrame::hasReceiptId() const
 {
-	return this->headerHasKey("receipt");
+	const P_D(QStompRequestFrame);
+	return d->hasHeader(QStompHeaderTable::HeaderReceipt);
 }
 
 QByteArray QStompRequestFrame::receiptId() const
 {
-	return this->headerValue("receipt");
+	const P_D(QStompRequestFrame);
+	return d->headerValue(QStompHeaderTable::HeaderReceipt);
 }
 
 void QStompRequestFrame::setReceiptId(const QByteArray &value)
 {
-	this->setHeaderValue("receipt", value);
+	P_D(QStompRequestFrame);
+	d->setHeaderValue(QStompHeaderTable::HeaderReceipt, value);
 }
 
 bool QStompRequestFrame::hasAckType() const
 {
-	return this->headerHasKey("ack");
+	const P_D(QStompRequestFrame);
+	return d->hasHeader(QStompHeaderTable::HeaderAck);
 }
 
 QStompRequestFrame::AckType QStompRequestFrame::ackType() const
 {
-	if (this->headerValue("ack") == "client")
+	const P_D(QStompRequestFrame);
+	if (d->headerValue(QStompHeaderTable::HeaderAck) == "client")
 		return QStompRequestFrame::AckClient;
 	return QStompRequestFrame::AckAuto;
 }
 
 void QStompRequestFrame::setAckType(QStompRequestFrame::AckType type)
 {
-	this->setHeaderValue("ack", (type == QStompRequestFrame::AckClient ? "client" : "auto"));
+	P_D(QStompRequestFrame);
+	d->setHeaderValue(QStompHeaderTable::HeaderAck, (type == QStompRequestFrame::AckClient ? "client" : "auto"));
 }
 
 bool QStompRequestFrame::hasSubscriptionId() const
 {
-	return this->headerHasKey("id");
+	const P_D(QStompRequestFrame);
+	return d->hasHeader(QStompHeaderTable::HeaderId);
 }
 
 QByteArray QStompRequestFrame::subscriptionId() const
 {
-	return this->headerValue("id");
+	const P_D(QStompRequestFrame);
+	return d->headerValue(QStompHeaderTable::HeaderId);
 }
 
 void QStompRequestFrame::setSubscriptionId(const QByteArray &value)
 {
-	this->setHeaderValue("id", value);
+	P_D(QStompRequestFrame);
+	d->setHeaderValue(QStompHeaderTable::HeaderId, value);
 }
 
 
@@ -698,11 +1223,64 @@ QStompClient::QStompClient(QObject *parent) : QObject(parent), pd_ptr(new QStomp
 {
 	P_D(QStompClient);
 	d->m_socket = NULL;
-	d->m_textCodec = QTextCodec::codecForName("utf-8");
+	d->m_ioEnabled = false;
+	d->m_ioCpu = -1;
+	d->m_ioThread = NULL;
+	d->m_io = NULL;
+	d->m_textCodec = defaultTextCodec();
+	d->m_profile = QStompClient::BalancedTransfer;
+	d->m_coalescingLimit = QSTOMP_COALESCING_LIMIT;
+	d->m_coalescingDelay = QSTOMP_COALESCING_DELAY;
+	d->m_outboundTail = false;
+	d->m_outboundBytes = 0;
+	d->m_outboundPolicy = QStompClient::BlockWhenFull;
+	d->m_outboundByteLimit = QSTOMP_OUTBOUND_BYTE_LIMIT;
+	d->m_outboundFrameLimit = QSTOMP_OUTBOUND_FRAME_LIMIT;
+	d->m_highWatermark = QSTOMP_HIGH_WATERMARK;
+	d->m_lowWatermark = QSTOMP_LOW_WATERMARK;
+	d->m_backlogBytes = 0;
+	d->m_congested = false;
+	d->m_inboundBudget = 0;
+	d->m_inboundLowWatermark = 0;
+	d->m_framebufferBytes = 0;
+	d->m_readPaused = false;
+	d->m_receiptWindow = QSTOMP_RECEIPT_WINDOW;
+	d->m_receiptCounter = 0;
+	d->m_batchReceipts = 0;
+	d->m_receiptWindowFull = false;
+	d->m_ackMode = QStompClient::IndividualAck;
+	d->m_ackBatchSize = QSTOMP_ACK_BATCH_SIZE;
+	d->m_ackBatchDelay = QSTOMP_ACK_BATCH_DELAY;
+	d->m_pendingAckCount = 0;
+	d->m_receiveSequence = 0;
+	d->m_ackTimer = new QTimer(this);
+	d->m_ackTimer->setSingleShot(true);
+	connect(d->m_ackTimer, SIGNAL(timeout()), this, SLOT(_q_flushAcks()));
+	d->m_batching = false;
+	d->m_batchSize = QSTOMP_BATCH_SIZE;
+	d->m_batchBytes = QSTOMP_BATCH_BYTES;
+	d->m_batchDelay = QSTOMP_BATCH_DELAY;
+	d->m_replayLimit = QSTOMP_REPLAY_LIMIT;
+	d->m_batchCounter = 0;
+	d->m_subscriptionCounter = 0;
+	d->m_batchTimer = new QTimer(this);
+	d->m_batchTimer->setSingleShot(true);
+	connect(d->m_batchTimer, SIGNAL(timeout()), this, SLOT(_q_commitBatch()));
+	d->m_flushTimer = new QTimer(this);
+	d->m_flushTimer->setSingleShot(true);
+	connect(d->m_flushTimer, SIGNAL(timeout()), this, SLOT(_q_flushOutbound()));
 }
 
 QStompClient::~QStompClient()
 {
+	P_D(QStompClient);
+	// Send what producers queued so far, later sends fail
+	if (d->m_producerQueue)
+		d->sendProducerNodes(d->m_producerQueue->close());
+	d->flushAcks();
+	d->commitBatch();
+	d->flushOutbound();
+	d->stopIo();
 	delete this->pd_ptr;
 }
 
@@ -711,43 +1289,78 @@ void QStompClient::connectToHost(const QString &hostname, quint16 port)
 	P_D(QStompClient);
 	if (d->m_socket != NULL && d->m_socket->parent() == this)
 		delete d->m_socket;
+	d->m_socket = NULL;
+	if (d->m_ioEnabled) {
+		d->startIo();
+		d->m_io->beginConnect(hostname, port);
+		return;
+	}
+	d->stopIo();
 	d->m_socket = new QTcpSocket(this);
-	connect(d->m_socket, SIGNAL(connected()), this, SIGNAL(socketConnected()));
-	connect(d->m_socket, SIGNAL(disconnected()), this, SIGNAL(socketDisconnected()));
-	connect(d->m_socket, SIGNAL(stateChanged(QAbstractSocket::SocketState)), this, SIGNAL(socketStateChanged(QAbstractSocket::SocketState)));
-	connect(d->m_socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SIGNAL(socketError(QAbstractSocket::SocketError)));
-	connect(d->m_socket, SIGNAL(readyRead()), this, SLOT(_q_socketReadyRead()));
+	d->attachSocket();
 	d->m_socket->connectToHost(hostname, port);
 }
 
 void QStompClient::setSocket(QTcpSocket *socket)
 {
 	P_D(QStompClient);
+	d->stopIo();
 	if (d->m_socket != NULL && d->m_socket->parent() == this)
 		delete d->m_socket;
 	d->m_socket = socket;
-	connect(d->m_socket, SIGNAL(connected()), this, SLOT(on_socketConnected()));
-	connect(d->m_socket, SIGNAL(disconnected()), this, SLOT(on_socketDisconnected()));
-	connect(d->m_socket, SIGNAL(stateChanged(QAbstractSocket::SocketState)), this, SLOT(on_socketStateChanged(QAbstractSocket::SocketState)));
-	connect(d->m_socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(on_socketError(QAbstractSocket::SocketError)));
-	connect(d->m_socket, SIGNAL(readyRead()), this, SLOT(on_socketReadyRead()));
+	d->attachSocket();
+	if (d->isConnected())
+		d->applySocketOptions();
 }
 
 QTcpSocket * QStompClient::socket() const
 {
-	const P_D(QStompClient);
+	// Whoever works with the socket directly (waitForBytesWritten() and the
+	// like) expects every frame sent so far to be in it
+	QStompClientPrivate * d = const_cast<QStompClient *>(this)->pd_func();
+	d->flushOutbound();
 	return d->m_socket;
 }
 
-void QStompClient::sendFrame(const QStompRequestFrame &frame)
+void QStompClient::flush()
 {
 	P_D(QStompClient);
-	if (d->m_socket == NULL || d->m_socket->state() != QAbstractSocket::ConnectedState)
-		return;
-	QByteArray serialized = frame.toByteArray();
-	serialized.append('\0');
-	serialized.append('\n');
-	d->m_socket->write(serialized);
+	d->flushOutbound();
+	d->drainBacklog();
+}
+
+bool QStompClient::isIoThreadEnabled() const
+{
+	const P_D(QStompClient);
+	return d->m_ioEnabled;
+}
+
+void QStompClient::setIoThreadEnabled(bool enabled)
+{
+	P_D(QStompClient);
+	d->m_ioEnabled = enabled;
+}
+
+int QStompClient::ioThreadCpu() const
+{
+	const P_D(QStompClient);
+	return d->m_ioCpu;
+}
+
+void QStompClient::setIoThreadCpu(int cpu)
+{
+	P_D(QStompClient);
+	d->m_ioCpu = cpu;
+	if (d->m_io != NULL && cpu >= 0)
+		QMetaObject::invokeMethod(d->m_io, "pinToCpu", Qt::QueuedConnection, Q_ARG(int, cpu));
+}
+
+bool QStompClient::sendFrame(const QStompRequestFrame &frame)
+{
+	P_D(QStompClient);
+	if (!d->hasSocket() || !frame.isValid())
+		return false;
+	return d->writeFrame(QStompRequestFramePrivate::get(frame));
 }
 
 void QStompClient::login(const QByteArray &user, const QByteArray &password)
@@ -760,6 +1373,9 @@ void QStompClient::login(const QByteArray &user, const QByteArray &password)
 
 void QStompClient::logout()
 {
+	P_D(QStompClient);
+	d->flushAcks();
+	d->commitBatch();
 	this->sendFrame(QStompRequestFrame(QStompRequestFrame::RequestDisconnect));
 }
 
@@ -773,6 +1389,27 @@ void QStompClient::send(const QByteArray &destination, const QString &body, cons
 	frame.setBody(body);
 	if (!transactionId.isNull())
 		frame.setTransactionId(transactionId);
+	else if (d->m_batching) {
+		d->batchSend(frame);
+		return;
+	}
+	this->sendFrame(frame);
+}
+
+void QStompClient::sendBytes(const QByteArray &destination, const QByteArray &rawBody, const QByteArray &transactionId, const QStompHeaderList &headers)
+{
+	P_D(QStompClient);
+	QStompRequestFrame frame(QStompRequestFrame::RequestSend);
+	frame.setHeaderValues(headers);
+	frame.setDestination(destination);
+	frame.setContentLength(rawBody.size());
+	frame.setRawBody(rawBody);
+	if (!transactionId.isNull())
+		frame.setTransactionId(transactionId);
+	else if (d->m_batching) {
+		d->batchSend(frame);
+		return;
+	}
 	this->sendFrame(frame);
 }
 
@@ -796,6 +1433,57 @@ void QStompClient::unsubscribe(const QByteArray &destination, const QStompHeader
 	this->sendFrame(frame);
 }
 
+QByteArray QStompClient::subscribe(const QByteArray &destination, bool autoAck, QStompMessageHandler * handler, const QStompHeaderList &headers)
+{
+	P_D(QStompClient);
+	if (handler == NULL) {
+		qWarning("QStomp: Cannot subscribe without a handler");
+		return QByteArray();
+	}
+	QStompSubscription subscription;
+	subscription.handler = handler;
+	return d->subscribe(destination, autoAck, subscription, headers);
+}
+
+QByteArray QStompClient::subscribe(const QByteArray &destination, bool autoAck, QObject * receiver, const char * member, const QStompHeaderList &headers)
+{
+	P_D(QStompClient);
+	if (receiver == NULL || member == NULL) {
+		qWarning("QStomp: Cannot subscribe without a receiver");
+		return QByteArray();
+	}
+	// Accept both SLOT(name(...)) and a plain signature
+	QByteArray signature = QMetaObject::normalizedSignature(member[0] >= '0' && member[0] <= '9' ? member + 1 : member);
+	int index = receiver->metaObject()->indexOfMethod(signature.constData());
+	if (index == -1) {
+		qWarning("QStomp: No such method %s::%s", receiver->metaObject()->className(), signature.constData());
+		return QByteArray();
+	}
+	const QMetaMethod method = receiver->metaObject()->method(index);
+	const QList<QByteArray> types = method.parameterTypes();
+	if (types.size() != 1 || types.first() != "QStompResponseFrame") {
+		qWarning("QStomp: %s::%s does not take a QStompResponseFrame", receiver->metaObject()->className(), signature.constData());
+		return QByteArray();
+	}
+	// Receivers on other threads get the frame queued
+	qRegisterMetaType<QStompResponseFrame>("QStompResponseFrame");
+
+	QStompSubscription subscription;
+	subscription.receiver = receiver;
+	subscription.method = method;
+	return d->subscribe(destination, autoAck, subscription, headers);
+}
+
+void QStompClient::unsubscribeId(const QByteArray &subscriptionId, const QStompHeaderList &headers)
+{
+	P_D(QStompClient);
+	d->m_subscriptions.remove(subscriptionId);
+	QStompRequestFrame frame(QStompRequestFrame::RequestUnsubscribe);
+	frame.setHeaderValues(headers);
+	frame.setSubscriptionId(subscriptionId);
+	this->sendFrame(frame);
+}
+
 void QStompClient::commit(const QByteArray &transactionId, const QStompHeaderList &headers)
 {
 	QStompRequestFrame frame(QStompRequestFrame::RequestCommit);
@@ -830,6 +1518,37 @@ void QStompClient::ack(const QByteArray &messageId, const QByteArray &transactio
 	this->sendFrame(frame);
 }
 
+void QStompClient::ack(const QStompResponseFrame &message)
+{
+	P_D(QStompClient);
+	// A cumulative ack covers everything received before it, acking an
+	// earlier message after a later one would take nothing back
+	const quint64 sequence = QStompResponseFramePrivate::get(message)->m_sequence;
+	if (d->m_ackMode == QStompClient::CumulativeAck && sequence != 0) {
+		quint64 &latest = d->m_ackedSequences[message.subscriptionId()];
+		if (sequence <= latest)
+			return;
+		latest = sequence;
+	}
+	QList<QByteArray> &ids = d->m_pendingAcks[message.subscriptionId()];
+	if (d->m_ackMode == QStompClient::CumulativeAck && !ids.isEmpty())
+		ids.last() = message.messageId();
+	else
+		ids.append(message.messageId());
+	d->m_pendingAckCount++;
+
+	if (d->m_pendingAckCount >= d->m_ackBatchSize)
+		d->flushAcks();
+	else if (!d->m_ackTimer->isActive())
+		d->m_ackTimer->start(d->m_ackBatchDelay);
+}
+
+void QStompClient::flushAcks()
+{
+	P_D(QStompClient);
+	d->flushAcks();
+}
+
 int QStompClient::framesAvailable() const
 {
 	const P_D(QStompClient);
@@ -839,8 +1558,12 @@ int QStompClient::framesAvailable() const
 QStompResponseFrame QStompClient::fetchFrame()
 {
 	P_D(QStompClient);
-	if (d->m_framebuffer.size() > 0)
-		return d->m_framebuffer.takeFirst();
+	if (d->m_framebuffer.size() > 0) {
+		QStompResponseFrame frame = d->m_framebuffer.takeFirst();
+		d->m_framebufferBytes -= d->m_frameSizes.takeFirst();
+		d->framesFetched();
+		return frame;
+	}
 	else
 		return QStompResponseFrame();
 }
@@ -848,22 +1571,25 @@ QStompResponseFrame QStompClient::fetchFrame()
 QList<QStompResponseFrame> QStompClient::fetchAllFrames()
 {
 	P_D(QStompClient);
-	QList<QStompResponseFrame> frames = d->m_framebuffer;
-	d->m_framebuffer.clear();
+	QList<QStompResponseFrame> frames;
+	qSwap(frames, d->m_framebuffer);
+	d->m_frameSizes.clear();
+	d->m_framebufferBytes = 0;
+	d->framesFetched();
 	return frames;
 }
 
 QAbstractSocket::SocketState QStompClient::socketState() const
 {
 	const P_D(QStompClient);
-	if (d->m_socket == NULL)
-		return QAbstractSocket::UnconnectedState;
-	return d->m_socket->state();
+	return d->socketState();
 }
 
 QAbstractSocket::SocketError QStompClient::socketError() const
 {
 	const P_D(QStompClient);
+	if (d->m_io != NULL)
+		return d->m_io->error();
 	if (d->m_socket == NULL)
 		return QAbstractSocket::UnknownSocketError;
 	return d->m_socket->error();
@@ -872,6 +1598,8 @@ QAbstractSocket::SocketError QStompClient::socketError() const
 QString QStompClient::socketErrorString() const
 {
 	const P_D(QStompClient);
+	if (d->m_io != NULL)
+		return d->m_io->errorString();
 	if (d->m_socket == NULL)
 		return QLatin1String("No socket");
 	return d->m_socket->errorString();
@@ -895,91 +1623,3143 @@ void QStompClient::setContentEncoding(const QTextCodec * codec)
 	d->m_textCodec = codec;
 }
 
-void QStompClient::disconnectFromHost()
+bool QStompClient::isZeroCopyEnabled() const
+{
+	const P_D(QStompClient);
+	return d->m_parser.zeroCopy();
+}
+
+void QStompClient::setZeroCopyEnabled(bool enabled)
 {
 	P_D(QStompClient);
-	if (d->m_socket != NULL)
-		d->m_socket->disconnectFromHost();
+	d->m_parser.setZeroCopy(enabled);
 }
 
-void QStompClientPrivate::_q_socketReadyRead()
+bool QStompClient::isHeaderInterningEnabled() const
 {
-	P_Q(QStompClient);
-	QByteArray data = this->m_socket->readAll();
-	this->m_buffer.append(data);
+	const P_D(QStompClient);
+	return d->m_parser.interning();
+}
 
-	quint32 length;
-	bool gotOne = false;
-	while ((length = this->findMessageBytes())) {
-		QStompResponseFrame frame(this->m_buffer.left(length));
-		if (frame.isValid()) {
-			this->m_framebuffer.append(frame);
-			gotOne = true;
-		}
+void QStompClient::setHeaderInterningEnabled(bool enabled)
+{
+	P_D(QStompClient);
+	d->m_parser.setInterning(enabled);
+}
+
+void QStompClient::disconnectFromHost()
+{
+	P_D(QStompClient);
+	if (d->hasSocket()) {
+		d->flushAcks();
+		d->commitBatch();
+		d->flushOutbound();
+		if (d->m_io != NULL)
+			QMetaObject::invokeMethod(d->m_io, "disconnectFromHost", Qt::QueuedConnection);
 		else
-			qDebug("QStomp: Invalid frame received!");
-		this->m_buffer.remove(0, length);
+			d->m_socket->disconnectFromHost();
 	}
-	if (gotOne)
-		emit q->frameReceived();
 }
 
+QStompClient::TransferProfile QStompClient::transferProfile() const
+{
+	const P_D(QStompClient);
+	return d->m_profile;
+}
 
-quint32 QStompClientPrivate::findMessageBytes()
+void QStompClient::setTransferProfile(QStompClient::TransferProfile profile)
 {
-	// Buffer sanity check
-	forever {
-		if (this->m_buffer.isEmpty())
-			return 0;
-		int nl = this->m_buffer.indexOf('\n');
-		if (nl == -1)
-			break;
-		QByteArray cmd = this->m_buffer.left(nl);
-		if (VALID_COMMANDS.contains(cmd))
-			break;
-		else {
-			qDebug("QStomp: Framebuffer corrupted, repairing...");
-			int syncPos = this->m_buffer.indexOf(QByteArray("\0\n", 2));
-			if (syncPos != -1)
-				this->m_buffer.remove(0, syncPos+2);
-			else {
-				syncPos = this->m_buffer.indexOf(QByteArray("\0", 1));
-				if (syncPos != -1)
-					this->m_buffer.remove(0, syncPos+1);
-				else
-					this->m_buffer.clear();
-			}
-		}
+	P_D(QStompClient);
+	d->m_profile = profile;
+	if (profile == QStompClient::LowLatencyTransfer)
+		d->flushOutbound();
+	if (d->isConnected())
+		d->applySocketOptions();
+}
+
+int QStompClient::coalescingLimit() const
+{
+	const P_D(QStompClient);
+	return d->m_coalescingLimit;
+}
+
+void QStompClient::setCoalescingLimit(int bytes)
+{
+	P_D(QStompClient);
+	d->m_coalescingLimit = bytes;
+}
+
+int QStompClient::coalescingDelay() const
+{
+	const P_D(QStompClient);
+	return d->m_coalescingDelay;
+}
+
+void QStompClient::setCoalescingDelay(int msecs)
+{
+	P_D(QStompClient);
+	d->m_coalescingDelay = msecs;
+}
+
+QStompClient::OutboundPolicy QStompClient::outboundPolicy() const
+{
+	const P_D(QStompClient);
+	return d->m_outboundPolicy;
+}
+
+void QStompClient::setOutboundPolicy(QStompClient::OutboundPolicy policy)
+{
+	P_D(QStompClient);
+	d->m_outboundPolicy = policy;
+}
+
+qint64 QStompClient::outboundByteLimit() const
+{
+	const P_D(QStompClient);
+	return d->m_outboundByteLimit;
+}
+
+void QStompClient::setOutboundByteLimit(qint64 bytes)
+{
+	P_D(QStompClient);
+	d->m_outboundByteLimit = bytes;
+}
+
+int QStompClient::outboundFrameLimit() const
+{
+	const P_D(QStompClient);
+	return d->m_outboundFrameLimit;
+}
+
+void QStompClient::setOutboundFrameLimit(int frames)
+{
+	P_D(QStompClient);
+	d->m_outboundFrameLimit = frames;
+}
+
+qint64 QStompClient::outboundHighWatermark() const
+{
+	const P_D(QStompClient);
+	return d->m_highWatermark;
+}
+
+void QStompClient::setOutboundHighWatermark(qint64 bytes)
+{
+	P_D(QStompClient);
+	d->m_highWatermark = bytes;
+	d->updateCongestion();
+}
+
+qint64 QStompClient::outboundLowWatermark() const
+{
+	const P_D(QStompClient);
+	return d->m_lowWatermark;
+}
+
+void QStompClient::setOutboundLowWatermark(qint64 bytes)
+{
+	P_D(QStompClient);
+	d->m_lowWatermark = bytes;
+	d->updateCongestion();
+}
+
+qint64 QStompClient::outboundBytes() const
+{
+	const P_D(QStompClient);
+	return d->bytesInFlight() + d->m_backlogBytes;
+}
+
+bool QStompClient::isOutboundCongested() const
+{
+	const P_D(QStompClient);
+	return d->m_congested;
+}
+
+qint64 QStompClient::inboundBudget() const
+{
+	const P_D(QStompClient);
+	return d->m_inboundBudget;
+}
+
+void QStompClient::setInboundBudget(qint64 bytes)
+{
+	P_D(QStompClient);
+	d->m_inboundBudget = bytes;
+	// Keep Qt's own buffer small so a paused client really stops reading,
+	// the I/O worker's socket is always kept small
+	if (d->m_io == NULL && d->m_socket != NULL)
+		d->m_socket->setReadBufferSize(bytes > 0 ? QSTOMP_READ_CHUNK : 0);
+	d->framesFetched();
+}
+
+qint64 QStompClient::inboundLowWatermark() const
+{
+	const P_D(QStompClient);
+	return d->m_inboundLowWatermark;
+}
+
+void QStompClient::setInboundLowWatermark(qint64 bytes)
+{
+	P_D(QStompClient);
+	d->m_inboundLowWatermark = bytes;
+	d->framesFetched();
+}
+
+qint64 QStompClient::inboundBytes() const
+{
+	const P_D(QStompClient);
+	return d->inboundBytes();
+}
+
+QByteArray QStompClient::sendConfirmed(const QStompRequestFrame &frame, QObject * receiver, const char * member)
+{
+	P_D(QStompClient);
+	if (d->m_receiptWindow > 0 && d->m_receipts.size() - d->m_batchReceipts >= d->m_receiptWindow) {
+		d->m_receiptWindowFull = true;
+		return QByteArray();
 	}
 
-	// Look for content-length
-	int headerEnd = this->m_buffer.indexOf("\n\n");
-	int clPos = this->m_buffer.indexOf("\ncontent-length");
-	if (clPos != -1 && headerEnd != -1 && clPos < headerEnd) {
-		int colon = this->m_buffer.indexOf(':', clPos);
-		int nl = this->m_buffer.indexOf('\n', clPos);
-		if (colon != -1 && nl != -1 && nl > colon) {
-			bool ok = false;
-			quint32 cl = this->m_buffer.mid(colon, nl-colon).toUInt(&ok) + headerEnd+2;
-			if (ok) {
-				if ((quint32)this->m_buffer.size() >= cl)
-					return cl;
-				else
-					return 0;
-			}
-		}
+	QByteArray id("qstomp-");
+	id.append(QByteArray::number(++d->m_receiptCounter));
+	QStompRequestFrame receipted(frame);
+	receipted.setReceiptId(id);
+
+	QStompPendingReceipt &pending = d->m_receipts[id];
+	pending.timer.start();
+	if (receiver != NULL && member != NULL) {
+		// Accept both SLOT(name(...)) and a plain method name
+		QByteArray method(member[0] >= '0' && member[0] <= '9' ? member + 1 : member);
+		int paren = method.indexOf('(');
+		if (paren != -1)
+			method.truncate(paren);
+		pending.receiver = receiver;
+		pending.method = method;
 	}
 
-	// No content-length, look for \0\n
-	int end = this->m_buffer.indexOf(QByteArray("\0\n", 2));
-	if (end == -1) {
-		// look for \0
-		end = this->m_buffer.indexOf(QByteArray("\0", 1));
-		if (end == -1)
-			return 0;
-		else
-			return (quint32) end+1;
+	if (!this->sendFrame(receipted)) {
+		d->m_receipts.remove(id);
+		return QByteArray();
 	}
-	else
-		return (quint32) end+2;
+	return id;
+}
+
+QStompClient::AckMode QStompClient::ackMode() const
+{
+	const P_D(QStompClient);
+	return d->m_ackMode;
+}
+
+void QStompClient::setAckMode(QStompClient::AckMode mode)
+{
+	P_D(QStompClient);
+	d->flushAcks();
+	d->m_ackMode = mode;
+}
+
+int QStompClient::ackBatchSize() const
+{
+	const P_D(QStompClient);
+	return d->m_ackBatchSize;
+}
+
+void QStompClient::setAckBatchSize(int acks)
+{
+	P_D(QStompClient);
+	d->m_ackBatchSize = acks;
+	if (d->m_pendingAckCount >= acks)
+		d->flushAcks();
+}
+
+int QStompClient::ackBatchDelay() const
+{
+	const P_D(QStompClient);
+	return d->m_ackBatchDelay;
+}
+
+void QStompClient::setAckBatchDelay(int msecs)
+{
+	P_D(QStompClient);
+	d->m_ackBatchDelay = msecs;
+}
+
+bool QStompClient::isTransactionBatchingEnabled() const
+{
+	const P_D(QStompClient);
+	return d->m_batching;
+}
+
+void QStompClient::setTransactionBatchingEnabled(bool enabled)
+{
+	P_D(QStompClient);
+	if (!enabled)
+		d->commitBatch();
+	d->m_batching = enabled;
+}
+
+int QStompClient::transactionBatchSize() const
+{
+	const P_D(QStompClient);
+	return d->m_batchSize;
+}
+
+void QStompClient::setTransactionBatchSize(int frames)
+{
+	P_D(QStompClient);
+	d->m_batchSize = frames;
+}
+
+qint64 QStompClient::transactionBatchBytes() const
+{
+	const P_D(QStompClient);
+	return d->m_batchBytes;
+}
+
+void QStompClient::setTransactionBatchBytes(qint64 bytes)
+{
+	P_D(QStompClient);
+	d->m_batchBytes = bytes;
+}
+
+int QStompClient::transactionBatchDelay() const
+{
+	const P_D(QStompClient);
+	return d->m_batchDelay;
+}
+
+void QStompClient::setTransactionBatchDelay(int msecs)
+{
+	P_D(QStompClient);
+	d->m_batchDelay = msecs;
+}
+
+int QStompClient::transactionReplayLimit() const
+{
+	const P_D(QStompClient);
+	return d->m_replayLimit;
+}
+
+void QStompClient::setTransactionReplayLimit(int replays)
+{
+	P_D(QStompClient);
+	d->m_replayLimit = replays;
+}
+
+void QStompClient::commitBatch()
+{
+	P_D(QStompClient);
+	d->commitBatch();
+}
+
+int QStompClient::receiptWindow() const
+{
+	const P_D(QStompClient);
+	return d->m_receiptWindow;
+}
+
+void QStompClient::setReceiptWindow(int frames)
+{
+	P_D(QStompClient);
+	d->m_receiptWindow = frames;
+}
+
+int QStompClient::receiptsPending() const
+{
+	const P_D(QStompClient);
+	return d->m_receipts.size() - d->m_batchReceipts;
+}
+
+int QStompClient::maxFrameSize() const
+{
+	const P_D(QStompClient);
+	return d->m_parser.maxFrameSize();
+}
+
+void QStompClient::setMaxFrameSize(int bytes)
+{
+	P_D(QStompClient);
+	d->m_parser.setMaxFrameSize(bytes);
+}
+
+void QStompClientPrivate::attachSocket()
+{
+	P_Q(QStompClient);
+	QObject::connect(this->m_socket, SIGNAL(connected()), q, SIGNAL(socketConnected()));
+	QObject::connect(this->m_socket, SIGNAL(disconnected()), q, SIGNAL(socketDisconnected()));
+	QObject::connect(this->m_socket, SIGNAL(stateChanged(QAbstractSocket::SocketState)), q, SIGNAL(socketStateChanged(QAbstractSocket::SocketState)));
+	QObject::connect(this->m_socket, SIGNAL(error(QAbstractSocket::SocketError)), q, SIGNAL(socketError(QAbstractSocket::SocketError)));
+	QObject::connect(this->m_socket, SIGNAL(readyRead()), q, SLOT(_q_socketReadyRead()));
+	QObject::connect(this->m_socket, SIGNAL(connected()), q, SLOT(_q_socketConnected()));
+	QObject::connect(this->m_socket, SIGNAL(disconnected()), q, SLOT(_q_socketDisconnected()));
+	QObject::connect(this->m_socket, SIGNAL(bytesWritten(qint64)), q, SLOT(_q_socketBytesWritten(qint64)));
+	if (this->m_inboundBudget > 0)
+		this->m_socket->setReadBufferSize(QSTOMP_READ_CHUNK);
+}
+
+static void applySocketOptions(QTcpSocket * socket, int lowDelay, int sendBuffer)
+{
+	socket->setSocketOption(QAbstractSocket::LowDelayOption, lowDelay);
+#if QT_VERSION >= 0x050300
+	if (sendBuffer > 0)
+		socket->setSocketOption(QAbstractSocket::SendBufferSizeSocketOption, sendBuffer);
+#else
+	Q_UNUSED(sendBuffer);
+#endif
+}
+
+void QStompClientPrivate::applySocketOptions()
+{
+	const int lowDelay = (this->m_profile == QStompClient::LowLatencyTransfer ? 1 : 0);
+	const int sendBuffer = (this->m_profile == QStompClient::HighThroughputTransfer ? QSTOMP_THROUGHPUT_SEND_BUFFER : 0);
+	if (this->m_io != NULL)
+		QMetaObject::invokeMethod(this->m_io, "setSocketOptions", Qt::QueuedConnection, Q_ARG(int, lowDelay), Q_ARG(int, sendBuffer));
+	else
+		::applySocketOptions(this->m_socket, lowDelay, sendBuffer);
+}
+
+void QStompClientPrivate::startIo()
+{
+	P_Q(QStompClient);
+	this->stopIo();
+	qRegisterMetaType<QAbstractSocket::SocketState>("QAbstractSocket::SocketState");
+	qRegisterMetaType<QAbstractSocket::SocketError>("QAbstractSocket::SocketError");
+
+	// The worker parses with the settings the client has at this point
+	this->m_io = new QStompIoWorker(q, QSTOMP_IO_RING_SIZE);
+	this->m_io->m_parser.setZeroCopy(this->m_parser.zeroCopy());
+	this->m_io->m_parser.setInterning(this->m_parser.interning());
+	this->m_io->m_parser.setMaxFrameSize(this->m_parser.maxFrameSize());
+	this->m_ioThread = new QThread();
+	this->m_ioThread->setObjectName(QLatin1String("QStomp I/O"));
+	this->m_io->moveToThread(this->m_ioThread);
+
+	QObject::connect(this->m_io, SIGNAL(connected()), q, SIGNAL(socketConnected()));
+	QObject::connect(this->m_io, SIGNAL(disconnected()), q, SIGNAL(socketDisconnected()));
+	QObject::connect(this->m_io, SIGNAL(stateChanged(QAbstractSocket::SocketState)), q, SIGNAL(socketStateChanged(QAbstractSocket::SocketState)));
+	QObject::connect(this->m_io, SIGNAL(error(QAbstractSocket::SocketError)), q, SIGNAL(socketError(QAbstractSocket::SocketError)));
+	QObject::connect(this->m_io, SIGNAL(connected()), q, SLOT(_q_socketConnected()));
+	QObject::connect(this->m_io, SIGNAL(disconnected()), q, SLOT(_q_socketDisconnected()));
+	QObject::connect(this->m_io, SIGNAL(bytesWritten(qint64)), q, SLOT(_q_socketBytesWritten(qint64)));
+
+	this->m_ioThread->start();
+	if (this->m_ioCpu >= 0)
+		QMetaObject::invokeMethod(this->m_io, "pinToCpu", Qt::QueuedConnection, Q_ARG(int, this->m_ioCpu));
+}
+
+void QStompClientPrivate::stopIo()
+{
+	P_Q(QStompClient);
+	if (this->m_io == NULL)
+		return;
+
+	// Signals still on their way would otherwise reach the next connection,
+	// so clean up for the old one right here. Frames left in the ring are
+	// dropped with it.
+	const bool wasOpen = (this->m_io->state() != QAbstractSocket::UnconnectedState);
+	QObject::disconnect(this->m_io, 0, q, 0);
+	QMetaObject::invokeMethod(this->m_io, "shutdown", Qt::BlockingQueuedConnection);
+	this->m_ioThread->quit();
+	this->m_ioThread->wait();
+	delete this->m_io;
+	delete this->m_ioThread;
+	this->m_io = NULL;
+	this->m_ioThread = NULL;
+	if (wasOpen)
+		this->_q_socketDisconnected();
+}
+
+bool QStompClientPrivate::hasEventLoop() const
+{
+	// Without a running event loop the flush timer never fires
+	const QStompClient * q = this->pq_func();
+#if QT_VERSION >= 0x050500
+	return q->thread()->loopLevel() > 0;
+#else
+	return QAbstractEventDispatcher::instance(q->thread()) != NULL;
+#endif
+}
+
+QAbstractSocket::SocketState QStompClientPrivate::socketState() const
+{
+	if (this->m_io != NULL)
+		return this->m_io->state();
+	if (this->m_socket == NULL)
+		return QAbstractSocket::UnconnectedState;
+	return this->m_socket->state();
+}
+
+void QStompClientPrivate::_q_socketConnected()
+{
+	this->applySocketOptions();
+	this->drainBacklog();
+}
+
+void QStompClientPrivate::_q_socketDisconnected()
+{
+	// Nothing queued can reach the broker any more
+	this->m_flushTimer->stop();
+	this->m_outbound.clear();
+	this->m_outboundTail = false;
+	this->m_outboundBytes = 0;
+	this->m_backlog.clear();
+	this->m_backlogBytes = 0;
+	this->updateCongestion();
+	this->failAllReceipts();
+
+	// The broker redelivers whatever was not acked
+	this->m_ackTimer->stop();
+	this->m_pendingAcks.clear();
+	this->m_pendingAckCount = 0;
+	this->m_ackedSequences.clear();
+
+	// and rolls back the open transaction, which is replayed after the next
+	// CONNECTED frame
+	this->m_batchTimer->stop();
+	if (!this->m_openBatch.transactionId.isEmpty()) {
+		QStompTransactionBatch batch = this->m_openBatch;
+		this->m_openBatch = QStompTransactionBatch();
+		this->failBatch(batch);
+	}
+}
+
+bool QStompClientPrivate::handleReceipt(const QStompResponseFrame &frame)
+{
+	if (this->m_receipts.isEmpty() || !frame.hasReceiptId())
+		return false;
+	QByteArray id = frame.receiptId();
+	if (!this->m_receipts.contains(id))
+		return false;
+
+	// A RECEIPT confirms the send and is used up, an ERROR fails it but is
+	// still passed on to the application
+	if (frame.type() == QStompResponseFrame::ResponseReceipt) {
+		this->finishReceipt(id, true);
+		return true;
+	}
+	if (frame.type() == QStompResponseFrame::ResponseError)
+		this->finishReceipt(id, false);
+	return false;
+}
+
+void QStompClientPrivate::finishReceipt(const QByteArray &receiptId, bool confirmed)
+{
+	P_Q(QStompClient);
+	QStompPendingReceipt pending = this->m_receipts.take(receiptId);
+	if (!pending.transactionId.isEmpty()) {
+		this->m_batchReceipts--;
+		this->finishBatch(pending.transactionId, confirmed);
+		return;
+	}
+#if QT_VERSION >= 0x040800
+	const qint64 usecs = pending.timer.nsecsElapsed() / 1000;
+#else
+	const qint64 usecs = pending.timer.elapsed() * 1000;
+#endif
+
+	// Receipts are mostly finished from inside the read loop, the handlers
+	// run later so they are free to send, read or delete the client
+	if (!pending.receiver.isNull())
+		QMetaObject::invokeMethod(pending.receiver, pending.method.constData(), Qt::QueuedConnection, Q_ARG(QByteArray, receiptId), Q_ARG(bool, confirmed), Q_ARG(qint64, usecs));
+	if (confirmed)
+		QMetaObject::invokeMethod(q, "receiptConfirmed", Qt::QueuedConnection, Q_ARG(QByteArray, receiptId), Q_ARG(qint64, usecs));
+	else
+		QMetaObject::invokeMethod(q, "receiptFailed", Qt::QueuedConnection, Q_ARG(QByteArray, receiptId));
+
+	if (this->m_receiptWindowFull && (this->m_receiptWindow <= 0 || this->m_receipts.size() - this->m_batchReceipts < this->m_receiptWindow)) {
+		this->m_receiptWindowFull = false;
+		QMetaObject::invokeMethod(q, "receiptWindowAvailable", Qt::QueuedConnection);
+	}
+}
+
+void QStompClientPrivate::batchSend(QStompRequestFrame &frame)
+{
+	P_Q(QStompClient);
+	if (this->m_openBatch.transactionId.isEmpty())
+		this->beginBatch();
+	frame.setTransactionId(this->m_openBatch.transactionId);
+	this->m_openBatch.frames.append(frame);
+	this->m_openBatch.bytes += frame.rawBody().size();
+	if (!q->sendFrame(frame)) {
+		// The broker has an incomplete transaction at best, abort it and
+		// keep the frames for replay
+		this->abortBatch();
+		return;
+	}
+
+	if (this->m_openBatch.frames.size() >= this->m_batchSize || (this->m_batchBytes > 0 && this->m_openBatch.bytes >= this->m_batchBytes))
+		this->commitBatch();
+	else if (!this->m_batchTimer->isActive())
+		this->m_batchTimer->start(this->m_batchDelay);
+}
+
+void QStompClientPrivate::beginBatch()
+{
+	P_Q(QStompClient);
+	this->m_openBatch.transactionId = "qstomp-tx-" + QByteArray::number(++this->m_batchCounter);
+	QStompRequestFrame frame(QStompRequestFrame::RequestBegin);
+	frame.setTransactionId(this->m_openBatch.transactionId);
+	q->sendFrame(frame);
+}
+
+void QStompClientPrivate::commitBatch()
+{
+	P_Q(QStompClient);
+	this->m_batchTimer->stop();
+	if (this->m_openBatch.transactionId.isEmpty())
+		return;
+
+	// The commit carries a receipt so the batch can be kept for replay until
+	// the broker confirms it
+	QByteArray receiptId = this->m_openBatch.transactionId + "-commit";
+	QStompPendingReceipt &pending = this->m_receipts[receiptId];
+	pending.timer.start();
+	pending.transactionId = this->m_openBatch.transactionId;
+	this->m_batchReceipts++;
+
+	QStompRequestFrame frame(QStompRequestFrame::RequestCommit);
+	frame.setTransactionId(this->m_openBatch.transactionId);
+	frame.setReceiptId(receiptId);
+	this->m_committing.append(this->m_openBatch);
+	this->m_openBatch = QStompTransactionBatch();
+	if (!q->sendFrame(frame))
+		this->finishReceipt(receiptId, false);
+}
+
+void QStompClientPrivate::abortBatch()
+{
+	P_Q(QStompClient);
+	this->m_batchTimer->stop();
+	if (this->m_openBatch.transactionId.isEmpty())
+		return;
+
+	QStompRequestFrame frame(QStompRequestFrame::RequestAbort);
+	frame.setTransactionId(this->m_openBatch.transactionId);
+	q->sendFrame(frame);
+	QStompTransactionBatch batch = this->m_openBatch;
+	this->m_openBatch = QStompTransactionBatch();
+	this->failBatch(batch);
+}
+
+void QStompClientPrivate::finishBatch(const QByteArray &transactionId, bool committed)
+{
+	P_Q(QStompClient);
+	for (int i = 0; i < this->m_committing.size(); i++) {
+		if (this->m_committing.at(i).transactionId != transactionId)
+			continue;
+		QStompTransactionBatch batch = this->m_committing.takeAt(i);
+		if (committed)
+			QMetaObject::invokeMethod(q, "batchCommitted", Qt::QueuedConnection, Q_ARG(QByteArray, batch.transactionId), Q_ARG(int, batch.frames.size()));
+		else
+			this->failBatch(batch);
+		return;
+	}
+}
+
+void QStompClientPrivate::failBatch(const QStompTransactionBatch &batch)
+{
+	P_Q(QStompClient);
+	if (batch.replays >= this->m_replayLimit) {
+		QMetaObject::invokeMethod(q, "batchFailed", Qt::QueuedConnection, Q_ARG(QByteArray, batch.transactionId), Q_ARG(int, batch.frames.size()));
+		return;
+	}
+	this->m_replay.append(batch);
+	this->m_replay.last().replays++;
+}
+
+void QStompClientPrivate::replayBatches()
+{
+	P_Q(QStompClient);
+	if (!this->isConnected())
+		return;
+
+	// Every failed batch goes out again as a transaction of its own
+	QList<QStompTransactionBatch> replay;
+	qSwap(replay, this->m_replay);
+	for (int i = 0; i < replay.size(); i++) {
+		QStompTransactionBatch open = this->m_openBatch;
+		this->m_batchTimer->stop();
+		this->m_openBatch = QStompTransactionBatch();
+		this->m_openBatch.replays = replay.at(i).replays;
+		this->beginBatch();
+		bool sent = true;
+		for (int j = 0; j < replay.at(i).frames.size() && sent; j++) {
+			QStompRequestFrame frame = replay.at(i).frames.at(j);
+			frame.setTransactionId(this->m_openBatch.transactionId);
+			this->m_openBatch.frames.append(frame);
+			this->m_openBatch.bytes += frame.rawBody().size();
+			sent = q->sendFrame(frame);
+		}
+
+		if (sent)
+			this->commitBatch();
+		else {
+			// Committing without the refused frame would lose it. Abort,
+			// and leave this and the remaining batches for the next attempt.
+			QStompRequestFrame abort(QStompRequestFrame::RequestAbort);
+			abort.setTransactionId(this->m_openBatch.transactionId);
+			q->sendFrame(abort);
+			this->failBatch(replay.at(i));
+			for (int k = i + 1; k < replay.size(); k++)
+				this->m_replay.append(replay.at(k));
+		}
+		this->m_openBatch = open;
+		if (!open.transactionId.isEmpty())
+			this->m_batchTimer->start(this->m_batchDelay);
+		if (!sent)
+			return;
+	}
+}
+
+QByteArray QStompClientPrivate::subscribe(const QByteArray &destination, bool autoAck, const QStompSubscription &subscription, const QStompHeaderList &headers)
+{
+	P_Q(QStompClient);
+	QByteArray id = "qstomp-sub-" + QByteArray::number(++this->m_subscriptionCounter);
+	this->m_subscriptions.insert(id, subscription);
+
+	QStompRequestFrame frame(QStompRequestFrame::RequestSubscribe);
+	frame.setHeaderValues(headers);
+	frame.setDestination(destination);
+	frame.setSubscriptionId(id);
+	frame.setAckType(autoAck ? QStompRequestFrame::AckAuto : QStompRequestFrame::AckClient);
+	if (!q->sendFrame(frame)) {
+		this->m_subscriptions.remove(id);
+		return QByteArray();
+	}
+	return id;
+}
+
+bool QStompClientPrivate::dispatchMessage(const QStompResponseFrame &frame)
+{
+	if (this->m_subscriptions.isEmpty() || frame.type() != QStompResponseFrame::ResponseMessage)
+		return false;
+	QHash<QByteArray, QStompSubscription>::const_iterator it = this->m_subscriptions.constFind(frame.subscriptionId());
+	if (it == this->m_subscriptions.constEnd())
+		return false;
+
+	// Copy out, the handler may unsubscribe
+	QStompSubscription subscription = it.value();
+	if (subscription.handler != NULL)
+		subscription.handler->handleMessage(frame);
+	else if (!subscription.receiver.isNull())
+		subscription.method.invoke(subscription.receiver, Qt::AutoConnection, Q_ARG(QStompResponseFrame, frame));
+	else {
+		// The receiver is gone, the frame goes into the frame buffer like
+		// any unrouted message
+		this->m_subscriptions.remove(frame.subscriptionId());
+		return false;
+	}
+	return true;
+}
+
+void QStompClientPrivate::flushAcks()
+{
+	P_Q(QStompClient);
+	this->m_ackTimer->stop();
+	if (this->m_pendingAckCount == 0)
+		return;
+
+	QHash<QByteArray, QList<QByteArray> > pending;
+	qSwap(pending, this->m_pendingAcks);
+	this->m_pendingAckCount = 0;
+
+	QHash<QByteArray, QList<QByteArray> >::const_iterator it;
+	for (it = pending.constBegin(); it != pending.constEnd(); ++it) {
+		const QList<QByteArray> &ids = it.value();
+		for (int i = 0; i < ids.size(); i++) {
+			QStompRequestFrame frame(QStompRequestFrame::RequestAck);
+			frame.setMessageId(ids.at(i));
+			if (!it.key().isEmpty())
+				frame.setHeaderValue(QByteArray(HEADER_NAMES[QStompHeaderTable::HeaderSubscription].name), it.key());
+			q->sendFrame(frame);
+		}
+	}
+
+	// All acks of the batch go out in one write
+	this->flushOutbound();
+}
+
+void QStompClientPrivate::failAllReceipts()
+{
+	while (!this->m_receipts.isEmpty())
+		this->finishReceipt(this->m_receipts.constBegin().key(), false);
+}
+
+void QStompClientPrivate::_q_socketBytesWritten(qint64 bytes)
+{
+	P_Q(QStompClient);
+	emit q->socketBytesWritten(bytes);
+	this->drainBacklog();
+}
+
+bool QStompClientPrivate::isConnected() const
+{
+	return this->socketState() == QAbstractSocket::ConnectedState;
+}
+
+qint64 QStompClientPrivate::inboundBytes() const
+{
+	return this->m_framebufferBytes + this->m_parser.bufferedBytes();
+}
+
+void QStompClientPrivate::framesFetched()
+{
+	P_Q(QStompClient);
+	if (!this->m_readPaused)
+		return;
+	if (this->m_inboundBudget > 0 && this->inboundBytes() > this->m_inboundLowWatermark)
+		return;
+
+	// Data that arrived while paused did not trigger readyRead, pick it up
+	// from the event loop
+	this->m_readPaused = false;
+	QMetaObject::invokeMethod(q, this->m_io != NULL ? "_q_ioFramesReady" : "_q_socketReadyRead", Qt::QueuedConnection);
+}
+
+bool QStompClientPrivate::writeFrame(const QStompRequestFramePrivate * frame)
+{
+	Command cmd = commandForRequestType(frame->m_type);
+	if (cmd == CommandUnknown)
+		return false;
+
+	// The head goes into the scratch buffer, the body is written from the
+	// frame itself so it is never copied here
+	this->m_scratch.resize(0);
+	frame->writeHead(this->m_scratch, COMMAND_NAMES[cmd].name, COMMAND_NAMES[cmd].length);
+	return this->writeSegments(this->m_scratch, frame->m_body, this->m_receipts.isEmpty() ? QByteArray() : frame->headerValue(QStompHeaderTable::HeaderReceipt));
+}
+
+bool QStompClientPrivate::writeSegments(const QByteArray &head, const QByteArray &body, const QByteArray &receiptId)
+{
+	if (!this->hasSocket())
+		return false;
+	switch (this->socketState()) {
+		case QAbstractSocket::ConnectedState:
+			if (this->m_congested || !this->m_backlog.isEmpty())
+				return this->enqueueBacklog(head, body, receiptId);
+			this->queueOutbound(head, body);
+			this->updateCongestion();
+			return true;
+		case QAbstractSocket::HostLookupState:
+		case QAbstractSocket::ConnectingState:
+			return this->enqueueBacklog(head, body, receiptId);
+		default:
+			return false;
+	}
+}
+
+bool QStompClientPrivate::backlogFull(qint64 size) const
+{
+	if (this->m_outboundByteLimit > 0 && this->m_backlogBytes + size > this->m_outboundByteLimit)
+		return true;
+	if (this->m_outboundFrameLimit > 0 && this->m_backlog.size() >= this->m_outboundFrameLimit)
+		return true;
+	return false;
+}
+
+bool QStompClientPrivate::enqueueBacklog(const QByteArray &head, const QByteArray &body, const QByteArray &receiptId)
+{
+	// Copy the head right away, it usually lives in the scratch buffer and
+	// blocking below may run handlers that send frames of their own
+	QStompOutboundFrame frame;
+	frame.head = QByteArray(head.constData(), head.size());
+	frame.body = body;
+	frame.receiptId = receiptId;
+	const qint64 size = head.size() + body.size() + 2;
+
+	while (this->backlogFull(size)) {
+		switch (this->m_outboundPolicy) {
+			case QStompClient::RejectWhenFull:
+				return false;
+			case QStompClient::DropOldestWhenFull: {
+				if (this->m_backlog.isEmpty())
+					return false;
+				// A dropped frame never gets its receipt
+				QStompOutboundFrame dropped = this->m_backlog.takeFirst();
+				this->m_backlogBytes -= dropped.head.size() + dropped.body.size() + 2;
+				if (!dropped.receiptId.isEmpty() && this->m_receipts.contains(dropped.receiptId))
+					this->finishReceipt(dropped.receiptId, false);
+				break;
+			}
+			case QStompClient::BlockWhenFull: {
+				bool progress;
+				if (this->isConnected()) {
+					// Flushing often hands everything to the kernel at once,
+					// which may already make room
+					const int step = (this->m_io != NULL ? this->m_io->progress() : 0);
+					this->flushOutbound();
+					this->drainBacklog();
+					if (!this->backlogFull(size))
+						break;
+					if (this->m_outboundBytes > 0)
+						progress = true;
+					else if (this->m_io != NULL)
+						progress = this->m_io->bytesToWrite() > 0 && this->m_io->waitForProgress(step, QSTOMP_BLOCK_TIMEOUT);
+					else
+						progress = this->m_socket->bytesToWrite() > 0 && this->m_socket->waitForBytesWritten(QSTOMP_BLOCK_TIMEOUT);
+				}
+				else if (this->m_io != NULL) {
+					// The socket belongs to the I/O thread, wait for it to
+					// report the next step
+					const int step = this->m_io->progress();
+					progress = this->m_io->waitForProgress(step, QSTOMP_BLOCK_TIMEOUT) && this->socketState() != QAbstractSocket::UnconnectedState;
+				}
+				else
+					progress = this->m_socket->waitForConnected(QSTOMP_BLOCK_TIMEOUT);
+				if (!progress)
+					return false;
+				this->drainBacklog();
+				break;
+			}
+		}
+	}
+
+	this->m_backlog.append(frame);
+	this->m_backlogBytes += size;
+	return true;
+}
+
+void QStompClientPrivate::drainBacklog()
+{
+	if (!this->isConnected())
+		return;
+	while (!this->m_backlog.isEmpty() && this->bytesInFlight() < this->m_highWatermark) {
+		QStompOutboundFrame frame = this->m_backlog.takeFirst();
+		this->m_backlogBytes -= frame.head.size() + frame.body.size() + 2;
+		this->queueOutbound(frame.head, frame.body);
+	}
+	this->updateCongestion();
+}
+
+qint64 QStompClientPrivate::bytesInFlight() const
+{
+	qint64 bytes = this->m_outboundBytes;
+	if (this->m_io != NULL)
+		bytes += this->m_io->bytesToWrite();
+	else if (this->m_socket != NULL)
+		bytes += this->m_socket->bytesToWrite();
+	return bytes;
+}
+
+void QStompClientPrivate::updateCongestion()
+{
+	P_Q(QStompClient);
+	const qint64 pending = this->bytesInFlight() + this->m_backlogBytes;
+	if (!this->m_congested && pending >= this->m_highWatermark) {
+		this->m_congested = true;
+		emit q->outboundCongested();
+	}
+	else if (this->m_congested && pending <= this->m_lowWatermark) {
+		this->m_congested = false;
+		emit q->outboundDrained();
+	}
+}
+
+void QStompClientPrivate::queueOutbound(const QByteArray &head, const QByteArray &body)
+{
+	static const char terminator[2] = { '\0', '\n' };
+
+	this->appendOutbound(head.constData(), head.size());
+	if (body.size() > QSTOMP_INLINE_BODY) {
+		this->m_outbound.append(body);
+		this->m_outboundTail = false;
+		this->m_outboundBytes += body.size();
+	}
+	else
+		this->appendOutbound(body.constData(), body.size());
+	this->appendOutbound(terminator, sizeof(terminator));
+
+	if (this->m_profile == QStompClient::LowLatencyTransfer || this->m_outboundBytes >= this->m_coalescingLimit || !this->hasEventLoop())
+		this->flushOutbound();
+	else if (!this->m_flushTimer->isActive())
+		this->m_flushTimer->start(this->m_profile == QStompClient::HighThroughputTransfer ? this->m_coalescingDelay : 0);
+}
+
+void QStompClientPrivate::appendOutbound(const char * data, int length)
+{
+	if (length == 0)
+		return;
+	if (!this->m_outboundTail) {
+		this->m_outbound.append(QByteArray());
+		this->m_outboundTail = true;
+	}
+	this->m_outbound.last().append(data, length);
+	this->m_outboundBytes += length;
+}
+
+// Writes the segments in order, with gathering writes where the socket
+// allows them and bypassing Qt is allowed. Returns the bytes that went
+// straight to the kernel, the socket does not signal bytesWritten() for them.
+static qint64 writeGathered(QTcpSocket * socket, const QByteArray * segments, int count, bool bypass)
+{
+	int next = 0;
+	qint64 skip = 0;
+	qint64 direct = 0;
+
+#ifdef Q_OS_UNIX
+	// With nothing queued in the socket the segments can go to the kernel
+	// in gathering writes. Subclasses such as QSslSocket may encrypt or
+	// frame what is written, only a plain QTcpSocket is written around.
+	const int fd = int(socket->socketDescriptor());
+	if (bypass && socket->metaObject() == &QTcpSocket::staticMetaObject && fd != -1 && socket->bytesToWrite() == 0) {
+#	ifdef MSG_NOSIGNAL
+		const int flags = MSG_NOSIGNAL;
+#	else
+		const int flags = 0;
+#	endif
+		while (next < count) {
+			const int batch = qMin(count - next, QSTOMP_GATHER_SEGMENTS);
+			QVarLengthArray<struct iovec, 64> iov(batch);
+			qint64 total = 0;
+			for (int i = 0; i < batch; i++) {
+				iov[i].iov_base = const_cast<char *>(segments[next + i].constData());
+				iov[i].iov_len = segments[next + i].size();
+				total += segments[next + i].size();
+			}
+
+			struct msghdr msg;
+			memset(&msg, 0, sizeof(msg));
+			msg.msg_iov = iov.data();
+			msg.msg_iovlen = batch;
+			ssize_t written;
+			do {
+				written = ::sendmsg(fd, &msg, flags);
+			} while (written == -1 && errno == EINTR);
+
+			if (written == total) {
+				direct += total;
+				next += batch;
+				continue;
+			}
+
+			// Whatever the kernel did not take is queued in the socket as
+			// usual, errors are left for Qt to run into and report
+			skip = (written < 0 ? 0 : written);
+			direct += skip;
+			while (skip >= segments[next].size()) {
+				skip -= segments[next].size();
+				next++;
+			}
+			break;
+		}
+	}
+#else
+	Q_UNUSED(bypass);
+#endif
+
+	for (; next < count; next++) {
+		socket->write(segments[next].constData() + skip, segments[next].size() - skip);
+		skip = 0;
+	}
+	return direct;
+}
+
+void QStompClientPrivate::flushOutbound()
+{
+	P_Q(QStompClient);
+	this->m_flushTimer->stop();
+	if (this->m_outbound.isEmpty())
+		return;
+	if (this->isConnected()) {
+		if (this->m_io != NULL)
+			this->m_io->post(this->m_outbound, int(this->m_outboundBytes));
+		else {
+			// Only sockets the client created itself are written around Qt,
+			// a socket given to setSocket() may have its own observers. The
+			// bytes are reported like the socket reports its own writes.
+			const qint64 direct = writeGathered(this->m_socket, this->m_outbound.constData(), this->m_outbound.size(), this->m_socket->parent() == q);
+			if (direct > 0)
+				QMetaObject::invokeMethod(q, "_q_socketBytesWritten", Qt::QueuedConnection, Q_ARG(qint64, direct));
+		}
+	}
+	this->m_outbound.clear();
+	this->m_outboundTail = false;
+	this->m_outboundBytes = 0;
+}
+
+void QStompClientPrivate::_q_socketReadyRead()
+{
+	P_Q(QStompClient);
+	if (this->m_socket == NULL)
+		return;
+
+	// Over budget, leave the data with the socket until frames are fetched.
+	// Only complete frames can hold reading back, otherwise a frame larger
+	// than the budget could never finish.
+	if (this->m_inboundBudget > 0 && this->m_framebufferBytes > 0 && this->inboundBytes() >= this->m_inboundBudget) {
+		this->m_readPaused = true;
+		return;
+	}
+	this->m_parser.readFrom(this->m_socket);
+
+	bool gotOne = false;
+	forever {
+		// A fresh frame every time, so filling it never has to detach from
+		// the copy that went into the frame buffer
+		QStompResponseFrame frame;
+		if (!this->m_parser.takeFrame(frame))
+			break;
+		if (frame.isValid()) {
+			if (this->deliverFrame(frame, this->m_parser.lastFrameSize()))
+				gotOne = true;
+		}
+		else
+			qDebug("QStomp: Invalid frame received!");
+	}
+	this->m_parser.compact();
+	if (gotOne)
+		emit q->frameReceived();
+}
+
+void QStompClientPrivate::_q_ioFramesReady()
+{
+	P_Q(QStompClient);
+	QStompIoWorker * io = this->m_io;
+	if (io == NULL)
+		return;
+
+	// Clear the flag before looking at the ring, frames pushed from here on
+	// wake the client again
+	io->m_wakeup.fetchAndStoreOrdered(0);
+
+	bool gotOne = false;
+	while (this->m_io == io) {
+		if (this->m_inboundBudget > 0 && this->m_framebufferBytes > 0 && this->inboundBytes() >= this->m_inboundBudget) {
+			this->m_readPaused = true;
+			break;
+		}
+		QStompResponseFrame frame;
+		int size;
+		if (!io->m_ring.pop(frame, size))
+			break;
+		if (this->deliverFrame(frame, size))
+			gotOne = true;
+	}
+
+	// A full ring stalls the worker, let it continue now there is room
+	if (this->m_io == io && !this->m_readPaused)
+		io->resume();
+	if (gotOne)
+		emit q->frameReceived();
+}
+
+// Handles a received frame, returns true if it went into the frame buffer
+bool QStompClientPrivate::deliverFrame(QStompResponseFrame &frame, int size)
+{
+	if (frame.type() == QStompResponseFrame::ResponseMessage)
+		QStompResponseFramePrivate::get(frame)->m_sequence = ++this->m_receiveSequence;
+	if (this->handleReceipt(frame) || this->dispatchMessage(frame))
+		return false;
+	if (frame.type() == QStompResponseFrame::ResponseError) {
+		// Only an ERROR naming the open batch aborts it. A failed commit is
+		// caught through its receipt, and replay waits for the next CONNECTED.
+		if (!this->m_openBatch.transactionId.isEmpty() && frame.headerValue("transaction") == this->m_openBatch.transactionId)
+			this->abortBatch();
+	}
+	else if (frame.type() == QStompResponseFrame::ResponseConnected)
+		this->replayBatches();
+	this->m_framebuffer.append(frame);
+	this->m_frameSizes.append(size);
+	this->m_framebufferBytes += size;
+	return true;
+}
+
+
+QStompFrameRing::QStompFrameRing(int capacity)
+{
+	uint size = 1;
+	while (size < uint(capacity))
+		size <<= 1;
+	this->m_slots = new Slot[size];
+	this->m_mask = size - 1;
+}
+
+QStompFrameRing::~QStompFrameRing()
+{
+	delete[] this->m_slots;
+}
+
+bool QStompFrameRing::push(QStompResponseFrame &frame, int size)
+{
+	const uint tail = uint(qstompLoadAcquire(this->m_tail));
+	if (tail - uint(qstompLoadAcquire(this->m_head)) > this->m_mask)
+		return false;
+	Slot &slot = this->m_slots[tail & this->m_mask];
+	slot.frame.swap(frame);
+	slot.size = size;
+	// Publishes the slot to the consumer
+	this->m_tail.fetchAndStoreRelease(int(tail + 1));
+	return true;
+}
+
+bool QStompFrameRing::pop(QStompResponseFrame &frame, int &size)
+{
+	const uint head = uint(qstompLoadAcquire(this->m_head));
+	if (head == uint(qstompLoadAcquire(this->m_tail)))
+		return false;
+	Slot &slot = this->m_slots[head & this->m_mask];
+	frame.swap(slot.frame);
+	size = slot.size;
+	// Hands the slot back to the producer
+	this->m_head.fetchAndStoreRelease(int(head + 1));
+	return true;
+}
+
+bool QStompFrameRing::isEmpty() const
+{
+	return qstompLoadAcquire(this->m_head) == qstompLoadAcquire(this->m_tail);
+}
+
+
+QStompIoWorker::QStompIoWorker(QStompClient * client, int ringSize) : m_ring(ringSize), m_client(client), m_socket(NULL)
+{
+	this->m_heldSize = 0;
+	this->m_holding = false;
+	this->m_progress = 0;
+}
+
+QString QStompIoWorker::errorString() const
+{
+	QMutexLocker locker(&this->m_mutex);
+	if (this->m_errorString.isNull())
+		return QLatin1String("No socket");
+	return this->m_errorString;
+}
+
+void QStompIoWorker::beginConnect(const QString &hostname, quint16 port)
+{
+	// Senders see a connection being set up right away, as they would with
+	// a socket of their own
+	this->m_state.fetchAndStoreRelease(QAbstractSocket::HostLookupState);
+	QMetaObject::invokeMethod(this, "connectToHost", Qt::QueuedConnection, Q_ARG(QString, hostname), Q_ARG(quint16, port));
+}
+
+void QStompIoWorker::post(const QVector<QByteArray> &segments, int bytes)
+{
+	this->m_queuedBytes.fetchAndAddOrdered(bytes);
+	this->m_mutex.lock();
+	this->m_outbound += segments;
+	this->m_mutex.unlock();
+	// One wakeup for everything posted until the worker gets to it
+	if (this->m_writePending.testAndSetOrdered(0, 1))
+		QMetaObject::invokeMethod(this, "writePending", Qt::QueuedConnection);
+}
+
+void QStompIoWorker::resume()
+{
+	if (this->m_stalled.testAndSetOrdered(1, 0))
+		QMetaObject::invokeMethod(this, "readFrames", Qt::QueuedConnection);
+}
+
+int QStompIoWorker::progress() const
+{
+	QMutexLocker locker(&this->m_mutex);
+	return this->m_progress;
+}
+
+bool QStompIoWorker::waitForProgress(int progress, int msecs)
+{
+	QMutexLocker locker(&this->m_mutex);
+	if (this->m_progress == progress)
+		this->m_progressed.wait(&this->m_mutex, msecs);
+	return this->m_progress != progress;
+}
+
+void QStompIoWorker::connectToHost(const QString &hostname, quint16 port)
+{
+	delete this->m_socket;
+	this->m_socket = new QTcpSocket(this);
+	connect(this->m_socket, SIGNAL(connected()), this, SIGNAL(connected()));
+	connect(this->m_socket, SIGNAL(disconnected()), this, SIGNAL(disconnected()));
+	connect(this->m_socket, SIGNAL(stateChanged(QAbstractSocket::SocketState)), this, SLOT(socketStateChanged(QAbstractSocket::SocketState)));
+	connect(this->m_socket, SIGNAL(error(QAbstractSocket::SocketError)), this, SLOT(socketError(QAbstractSocket::SocketError)));
+	connect(this->m_socket, SIGNAL(readyRead()), this, SLOT(readFrames()));
+	connect(this->m_socket, SIGNAL(bytesWritten(qint64)), this, SLOT(socketBytesWritten(qint64)));
+	// A full ring stops the worker from reading, Qt must not go on
+	// buffering behind its back
+	this->m_socket->setReadBufferSize(QSTOMP_READ_CHUNK);
+	this->m_socket->connectToHost(hostname, port);
+}
+
+void QStompIoWorker::disconnectFromHost()
+{
+	if (this->m_socket != NULL)
+		this->m_socket->disconnectFromHost();
+}
+
+void QStompIoWorker::setSocketOptions(int lowDelay, int sendBuffer)
+{
+	if (this->m_socket != NULL)
+		applySocketOptions(this->m_socket, lowDelay, sendBuffer);
+}
+
+void QStompIoWorker::pinToCpu(int cpu)
+{
+#ifdef Q_OS_LINUX
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		qWarning("QStomp: Could not pin the I/O thread to CPU %d", cpu);
+#else
+	Q_UNUSED(cpu);
+	qWarning("QStomp: Pinning the I/O thread is not supported on this platform");
+#endif
+}
+
+void QStompIoWorker::readFrames()
+{
+	// Nothing more is read while a frame is still waiting for room
+	if (this->m_holding) {
+		if (!this->deliver(this->m_held, this->m_heldSize))
+			return;
+		this->m_holding = false;
+	}
+
+	for (int pass = 0; pass < 2; pass++) {
+		// Frames left in the buffer by a stall go before new data
+		if (pass == 1 && this->m_socket != NULL)
+			this->m_parser.readFrom(this->m_socket);
+		forever {
+			QStompResponseFrame frame;
+			if (!this->m_parser.takeFrame(frame))
+				break;
+			if (!frame.isValid()) {
+				qDebug("QStomp: Invalid frame received!");
+				continue;
+			}
+			if (!this->deliver(frame, this->m_parser.lastFrameSize())) {
+				this->m_held.swap(frame);
+				this->m_heldSize = this->m_parser.lastFrameSize();
+				this->m_holding = true;
+				this->m_parser.compact();
+				return;
+			}
+		}
+	}
+	this->m_parser.compact();
+	this->wakeClient();
+}
+
+void QStompIoWorker::writePending()
+{
+	this->m_writePending.fetchAndStoreOrdered(0);
+	QVector<QByteArray> segments;
+	this->m_mutex.lock();
+	qSwap(segments, this->m_outbound);
+	this->m_mutex.unlock();
+	if (segments.isEmpty())
+		return;
+
+	int bytes = 0;
+	qint64 direct = 0;
+	for (int i = 0; i < segments.size(); i++)
+		bytes += segments.at(i).size();
+	if (this->m_socket != NULL && this->m_socket->state() == QAbstractSocket::ConnectedState)
+		direct = writeGathered(this->m_socket, segments.constData(), segments.size(), true);
+	this->updateSocketBytes();
+	this->m_queuedBytes.fetchAndAddOrdered(-bytes);
+
+	// The socket never signals what went straight to the kernel, everything
+	// else is reported when the socket writes it
+	if (direct > 0)
+		emit bytesWritten(direct);
+	this->signalProgress();
+}
+
+void QStompIoWorker::shutdown()
+{
+	this->writePending();
+	if (this->m_socket == NULL)
+		return;
+	while (this->m_socket->bytesToWrite() > 0 && this->m_socket->waitForBytesWritten(QSTOMP_IO_SHUTDOWN_TIMEOUT))
+		;
+	this->m_socket->disconnect(this);
+	delete this->m_socket;
+	this->m_socket = NULL;
+	this->m_state.fetchAndStoreRelease(QAbstractSocket::UnconnectedState);
+}
+
+void QStompIoWorker::socketStateChanged(QAbstractSocket::SocketState state)
+{
+	this->m_state.fetchAndStoreRelease(state);
+	emit stateChanged(state);
+	this->signalProgress();
+}
+
+void QStompIoWorker::socketError(QAbstractSocket::SocketError code)
+{
+	this->m_mutex.lock();
+	this->m_errorString = this->m_socket->errorString();
+	this->m_mutex.unlock();
+	this->m_error.fetchAndStoreRelease(code);
+	emit error(code);
+}
+
+void QStompIoWorker::socketBytesWritten(qint64 bytes)
+{
+	this->updateSocketBytes();
+	emit bytesWritten(bytes);
+	this->signalProgress();
+}
+
+bool QStompIoWorker::deliver(QStompResponseFrame &frame, int size)
+{
+	if (this->m_ring.push(frame, size))
+		return true;
+
+	// Flag the stall before trying again, so the client either sees the flag
+	// or has already made room
+	this->m_stalled.fetchAndStoreOrdered(1);
+	if (!this->m_ring.push(frame, size)) {
+		this->wakeClient();
+		return false;
+	}
+	this->m_stalled.testAndSetOrdered(1, 0);
+	return true;
+}
+
+void QStompIoWorker::wakeClient()
+{
+	if (!this->m_ring.isEmpty() && this->m_wakeup.testAndSetOrdered(0, 1))
+		QMetaObject::invokeMethod(this->m_client, "_q_ioFramesReady", Qt::QueuedConnection);
+}
+
+void QStompIoWorker::signalProgress()
+{
+	QMutexLocker locker(&this->m_mutex);
+	this->m_progress++;
+	this->m_progressed.wakeAll();
+}
+
+void QStompIoWorker::updateSocketBytes()
+{
+	const qint64 bytes = (this->m_socket != NULL ? this->m_socket->bytesToWrite() : 0);
+	this->m_socketBytes.fetchAndStoreRelease(int(qMin(bytes, Q_INT64_C(0x7fffffff))));
+}
+
+
+QStompFrameParser::QStompFrameParser()
+{
+	this->m_buffer.reserve(QSTOMP_READ_CHUNK);
+	this->m_offset = 0;
+	this->m_maxFrameSize = QSTOMP_MAX_FRAME_SIZE;
+	this->m_lastFrameSize = 0;
+	this->m_skipRemaining = 0;
+	this->m_resyncCount = 0;
+	this->m_skippedBytes = 0;
+	this->m_droppedCount = 0;
+	this->m_zeroCopy = false;
+	this->m_interning = false;
+	this->resetFrame();
+}
+
+void QStompFrameParser::resetFrame()
+{
+	this->m_scan = this->m_offset;
+	this->m_state = QStompFrameParser::StateCommand;
+	this->m_valid = true;
+	this->m_type = QStompResponseFrame::ResponseInvalid;
+	this->m_headerStart = -1;
+	this->m_headerEnd = -1;
+	this->m_bodyStart = -1;
+	this->m_contentLength = -1;
+}
+
+void QStompFrameParser::readFrom(QIODevice * device)
+{
+	// Read directly into the spare room at the end of the buffer instead of
+	// going through a temporary QByteArray
+	qint64 available = device->bytesAvailable();
+	if (available <= 0)
+		return;
+
+	int oldSize = this->m_buffer.size();
+	int newSize = oldSize + (int) available;
+	if (newSize > this->m_buffer.capacity())
+		this->m_buffer.reserve(qMax(newSize, 2 * this->m_buffer.capacity()));
+	this->m_buffer.resize(newSize);
+
+	qint64 got = device->read(this->m_buffer.data() + oldSize, available);
+	this->m_buffer.resize(oldSize + (int) qMax(got, Q_INT64_C(0)));
+}
+
+void QStompFrameParser::compact()
+{
+	// Consumed bytes are only dropped here, once per read, so the tail is
+	// moved at most once no matter how many frames were extracted
+	if (this->m_offset == 0)
+		return;
+	this->m_buffer.remove(0, this->m_offset);
+	this->m_scan -= this->m_offset;
+	if (this->m_headerStart != -1)
+		this->m_headerStart -= this->m_offset;
+	if (this->m_headerEnd != -1)
+		this->m_headerEnd -= this->m_offset;
+	if (this->m_bodyStart != -1)
+		this->m_bodyStart -= this->m_offset;
+	this->m_offset = 0;
+}
+
+bool QStompFrameParser::takeFrame(QStompResponseFrame &frame)
+{
+	const char * data = this->m_buffer.constData();
+	const int size = this->m_buffer.size();
+
+	forever {
+		switch (this->m_state) {
+			case QStompFrameParser::StateCommand: {
+				// Skip the EOLs between frames before looking at a new command
+				if (this->m_scan == this->m_offset) {
+					while (this->m_offset < size && data[this->m_offset] == '\n')
+						this->m_offset++;
+					this->m_scan = this->m_offset;
+				}
+				int nl = scanFor(data, this->m_scan, size, '\n', '\0');
+				if (nl == -1) {
+					this->m_scan = size;
+					// A command line that never ends must not grow the buffer
+					if (this->m_maxFrameSize > 0 && size - this->m_offset > this->m_maxFrameSize) {
+						this->dropFrame(-1);
+						continue;
+					}
+					return false;
+				}
+				Command cmd = (data[nl] == '\0' ? CommandUnknown : commandForName(data + this->m_offset, nl - this->m_offset));
+				if (cmd == CommandUnknown) {
+					// Drop everything up to the end of the broken frame
+					int syncPos = (data[nl] == '\0' ? nl : scanFor(data, nl, size, '\0'));
+					this->resync(syncPos == -1 ? size : syncPos + 1);
+					continue;
+				}
+				this->m_type = responseTypeForCommand(cmd);
+				this->m_scan = nl + 1;
+				this->m_headerStart = this->m_scan;
+				this->m_state = QStompFrameParser::StateHeaders;
+				break;
+			}
+			case QStompFrameParser::StateHeaders: {
+				int nl = scanFor(data, this->m_scan, size, '\n', '\0');
+				if (nl == -1) {
+					if (this->m_maxFrameSize > 0 && size - this->m_offset > this->m_maxFrameSize) {
+						this->dropFrame(-1);
+						continue;
+					}
+					return false;
+				}
+				if (data[nl] == '\0') {
+					// The frame ended inside its header
+					this->m_valid = false;
+					this->m_headerEnd = nl;
+					this->m_bodyStart = nl;
+					this->finishFrame(frame, 0, nl + 1);
+					return true;
+				}
+				if (nl == this->m_scan) {
+					this->m_headerEnd = nl;
+					this->m_bodyStart = nl + 1;
+					this->m_scan = this->m_bodyStart;
+					if (this->m_maxFrameSize > 0 && this->m_contentLength >= 0 && this->m_bodyStart - this->m_offset + this->m_contentLength >= this->m_maxFrameSize)
+						this->dropFrame(this->m_bodyStart - this->m_offset + this->m_contentLength);
+					else if (this->m_contentLength >= 0)
+						this->m_state = QStompFrameParser::StateBodyByLength;
+					else
+						this->m_state = QStompFrameParser::StateBodyToNul;
+					break;
+				}
+				this->scanHeaderLine(this->m_scan, nl);
+				this->m_scan = nl + 1;
+				break;
+			}
+			case QStompFrameParser::StateBodyByLength: {
+				// The body is followed by its NUL terminator
+				qint64 end = this->m_bodyStart + this->m_contentLength;
+				if (end >= size)
+					return false;
+				if (data[end] != '\0') {
+					// Wrong content-length, the frame ends at the first NUL
+					// instead, the next frame must not lose a byte
+					this->m_valid = false;
+					this->m_scan = this->m_bodyStart;
+					this->m_state = QStompFrameParser::StateBodyToNul;
+					break;
+				}
+				this->finishFrame(frame, (int) this->m_contentLength, (int) end + 1);
+				return true;
+			}
+			case QStompFrameParser::StateBodyToNul: {
+				int nul = scanFor(data, this->m_scan, size, '\0');
+				if (nul == -1) {
+					this->m_scan = size;
+					if (this->m_maxFrameSize > 0 && size - this->m_offset > this->m_maxFrameSize) {
+						this->dropFrame(-1);
+						continue;
+					}
+					return false;
+				}
+				this->finishFrame(frame, nul - this->m_bodyStart, nul + 1);
+				return true;
+			}
+			case QStompFrameParser::StateSkipBytes: {
+				// Discard input as it arrives instead of buffering the frame
+				qint64 n = qMin(this->m_skipRemaining, qint64(size - this->m_offset));
+				this->m_offset += (int) n;
+				this->m_scan = this->m_offset;
+				this->m_skipRemaining -= n;
+				if (this->m_skipRemaining > 0)
+					return false;
+				this->m_state = QStompFrameParser::StateSkipToNul;
+				break;
+			}
+			case QStompFrameParser::StateSkipToNul: {
+				int nul = scanFor(data, this->m_scan, size, '\0');
+				if (nul == -1) {
+					this->m_offset = size;
+					this->m_scan = size;
+					return false;
+				}
+				this->m_offset = nul + 1;
+				this->resetFrame();
+				break;
+			}
+		}
+	}
+}
+
+void QStompFrameParser::resync(int to)
+{
+	// Report the first resync and then only every power of two, a badly
+	// broken stream must not turn into a flood of log lines
+	this->m_skippedBytes += to - this->m_offset;
+	this->m_resyncCount++;
+	if ((this->m_resyncCount & (this->m_resyncCount - 1)) == 0)
+		qDebug("QStomp: Framebuffer corrupted, repaired %d times (%lld bytes skipped)", this->m_resyncCount, (long long) this->m_skippedBytes);
+	this->m_offset = to;
+	this->m_scan = to;
+}
+
+void QStompFrameParser::dropFrame(qint64 length)
+{
+	this->m_droppedCount++;
+	if ((this->m_droppedCount & (this->m_droppedCount - 1)) == 0)
+		qDebug("QStomp: Frame larger than %d bytes dropped (%d so far)", this->m_maxFrameSize, this->m_droppedCount);
+
+	// Skip the announced length if there is one, then up to the terminator
+	if (length >= 0) {
+		this->m_skipRemaining = length;
+		this->m_state = QStompFrameParser::StateSkipBytes;
+	}
+	else
+		this->m_state = QStompFrameParser::StateSkipToNul;
+	this->m_scan = this->m_offset;
+}
+
+void QStompFrameParser::scanHeaderLine(int start, int end)
+{
+	const char * data = this->m_buffer.constData();
+	int colon = scanFor(data, start, end, ':');
+	if (colon == -1) {
+		this->m_valid = false;
+		return;
+	}
+
+	// Only content-length is needed to find the end of the frame, the rest
+	// of the header is left for the frame to tokenize when it is asked for
+	if (this->m_contentLength < 0 && colon - start >= 14 && qstrnicmp(data + start, "content-length", 14) == 0) {
+		QStompHeaderSpan span;
+		if (headerLineSpan(data, start, end, span) && span.keyLength == 14) {
+			bool ok = false;
+			uint len = QByteArray::fromRawData(data + span.valuePos, span.valueLength).toUInt(&ok);
+			if (ok)
+				this->m_contentLength = len;
+		}
+	}
+}
+
+void QStompFrameParser::finishFrame(QStompResponseFrame &frame, int bodyLength, int end)
+{
+	this->m_lastFrameSize = end - this->m_offset;
+	QStompResponseFramePrivate * d = QStompResponseFramePrivate::get(frame);
+	d->m_type = this->m_type;
+	d->m_valid = this->m_valid && this->m_type != QStompResponseFrame::ResponseInvalid;
+	d->m_header.clear();
+
+	if (this->m_interning) {
+		// Tokenize right away so repeated keys and values can be swapped
+		// for the client-wide shared copies
+		this->internHeader(d);
+		d->m_raw.clear();
+		d->m_headerState.fetchAndStoreRelaxed(QStompFramePrivate::HeaderParsed);
+		d->m_headerPos = 0;
+		d->m_headerLength = 0;
+		d->m_headerViews = false;
+		d->m_body = this->m_buffer.mid(this->m_bodyStart, bodyLength);
+		this->m_offset = end;
+		this->resetFrame();
+		return;
+	}
+
+	if (this->m_zeroCopy) {
+		// Copy the frame once; header fields and body are views into that
+		// chunk, which the frame keeps alive through m_raw
+		d->m_raw = this->m_buffer.mid(this->m_offset, end - this->m_offset);
+		d->m_headerPos = this->m_headerStart - this->m_offset;
+		d->m_body = QByteArray::fromRawData(d->m_raw.constData() + this->m_bodyStart - this->m_offset, bodyLength);
+	}
+	else {
+		d->m_raw = this->m_buffer.mid(this->m_headerStart, this->m_headerEnd - this->m_headerStart);
+		d->m_headerPos = 0;
+		d->m_body = this->m_buffer.mid(this->m_bodyStart, bodyLength);
+	}
+	d->m_headerLength = this->m_headerEnd - this->m_headerStart;
+	d->m_headerViews = this->m_zeroCopy;
+	d->m_headerState.fetchAndStoreRelaxed(QStompFramePrivate::HeaderPending);
+
+	this->m_offset = end;
+	this->resetFrame();
+}
+
+
+void QStompFrameParser::internHeader(QStompFramePrivate * d)
+{
+	const char * data = this->m_buffer.constData();
+	int pos = this->m_headerStart;
+	const int end = this->m_headerEnd;
+	while (pos < end) {
+		int nl = scanFor(data, pos, end, '\n');
+		if (nl == -1)
+			nl = end;
+		QStompHeaderSpan span;
+		if (headerLineSpan(data, pos, nl, span)) {
+			QByteArray key = this->m_intern.intern(data + span.keyPos, span.keyLength);
+			switch (knownHeaderForName(key.constData(), key.size())) {
+				case QStompHeaderTable::HeaderDestination:
+				case QStompHeaderTable::HeaderSubscription:
+				case QStompHeaderTable::HeaderContentType:
+				case QStompHeaderTable::HeaderContentEncoding:
+				case QStompHeaderTable::HeaderAck:
+					d->m_header.appendShared(key, this->m_intern.intern(data + span.valuePos, span.valueLength));
+					break;
+				default:
+					d->m_header.appendShared(key, data + span.valuePos, span.valueLength);
+			}
+		}
+		pos = nl + 1;
+	}
+}
+
+
+QByteArray QStompInternTable::intern(const char * data, int length)
+{
+	QSet<QByteArray>::ConstIterator it = this->m_strings.constFind(QByteArray::fromRawData(data, length));
+	if (it != this->m_strings.constEnd())
+		return *it;
+
+	// Start over rather than grow without bound on high-cardinality values;
+	// frames keep the strings they already reference
+	if (this->m_strings.size() >= QSTOMP_INTERN_LIMIT)
+		this->m_strings.clear();
+
+	QByteArray copy(data, length);
+	this->m_strings.insert(copy);
+	return copy;
+}
+
+void QStompInternTable::clear()
+{
+	this->m_strings.clear();
+}
+
+
+void QStompFramePrivate::parseHeader() const
+{
+	// Copies of a frame share this private, possibly across threads: the
+	// first reader tokenizes, everyone else waits for it to finish
+	if (!this->m_headerState.testAndSetAcquire(QStompFramePrivate::HeaderPending, QStompFramePrivate::HeaderParsing)) {
+		while (qstompLoadAcquire(this->m_headerState) != QStompFramePrivate::HeaderParsed)
+			QThread::yieldCurrentThread();
+		return;
+	}
+
+	const char * data = this->m_raw.constData();
+	int pos = this->m_headerPos;
+	const int end = pos + this->m_headerLength;
+
+	// Size the entry table up front so tokenizing costs a single allocation
+	int lines = 0;
+	for (int i = scanFor(data, pos, end, '\n'); i != -1; i = scanFor(data, i + 1, end, '\n'))
+		lines++;
+	this->m_header.setSource(this->m_raw, this->m_headerViews);
+	this->m_header.reserve(lines + 1);
+
+	while (pos < end) {
+		int nl = scanFor(data, pos, end, '\n');
+		if (nl == -1)
+			nl = end;
+		QStompHeaderSpan span;
+		if (headerLineSpan(data, pos, nl, span))
+			this->m_header.appendSpan(span);
+		pos = nl + 1;
+	}
+	this->m_headerState.fetchAndStoreRelease(QStompFramePrivate::HeaderParsed);
+}
+
+void QStompFramePrivate::writeHead(QByteArray &out, const char * command, int commandLength) const
+{
+	this->ensureHeader();
+
+	// Size the output once, then fill it in place
+	int length = commandLength + (commandLength > 0 ? 1 : 0) + 1;
+	for (int i = 0; i < this->m_header.size(); i++)
+		length += this->m_header.keyLength(i) + 2 + this->m_header.valueLength(i) + 1;
+	int pos = out.size();
+	out.resize(pos + length);
+	char * p = out.data() + pos;
+
+	if (commandLength > 0) {
+		memcpy(p, command, commandLength);
+		p += commandLength;
+		*p++ = '\n';
+	}
+	for (int i = 0; i < this->m_header.size(); i++) {
+		const int keyLength = this->m_header.keyLength(i);
+		memcpy(p, this->m_header.keyData(i), keyLength);
+		p += keyLength;
+		*p++ = ':';
+		// Some brokers do not accept a space in front of the credentials
+		const int known = this->m_header.knownAt(i);
+		if (known != QStompHeaderTable::HeaderLogin && known != QStompHeaderTable::HeaderPasscode)
+			*p++ = ' ';
+		const int valueLength = this->m_header.valueLength(i);
+		memcpy(p, this->m_header.valueData(i), valueLength);
+		p += valueLength;
+		*p++ = '\n';
+	}
+	*p++ = '\n';
+	out.resize(int(p - out.constData()));
+}
+
+void QStompFramePrivate::copyFrameFrom(const QStompFramePrivate &other)
+{
+	this->m_raw = other.m_raw;
+	this->m_header = other.m_header;
+	this->m_headerState.fetchAndStoreRelaxed(QStompFramePrivate::HeaderParsed);
+	this->m_headerPos = other.m_headerPos;
+	this->m_headerLength = other.m_headerLength;
+	this->m_headerViews = other.m_headerViews;
+	this->m_valid = other.m_valid;
+	this->m_body = other.m_body;
+	this->m_textCodec = other.m_textCodec;
+}
+
+QStompResponseFramePrivate * QStompResponseFramePrivate::sharedNull()
+{
+	static const QStompResponseFrame null;
+	QStompResponseFramePrivate * d = const_cast<QStompResponseFramePrivate *>(null.pd_func());
+	d->ref.ref();
+	return d;
+}
+
+QStompRequestFramePrivate * QStompRequestFramePrivate::sharedNull()
+{
+	static const QStompRequestFrame null;
+	QStompRequestFramePrivate * d = const_cast<QStompRequestFramePrivate *>(null.pd_func());
+	d->ref.ref();
+	return d;
+}
+
+
+QStompHeaderTable::QStompHeaderTable() : m_garbage(0), m_contentLength(0), m_borrowed(false), m_views(false)
+{
+	this->resetKnown();
+}
+
+QByteArray QStompHeaderTable::keyAt(int i) const
+{
+	const int pos = this->m_entries.at(i).keyPos;
+	if (pos < 0)
+		return this->m_shared.at(-pos - 1);
+	if (this->m_views)
+		return QByteArray::fromRawData(this->keyData(i), this->keyLength(i));
+	return QByteArray(this->keyData(i), this->keyLength(i));
+}
+
+QByteArray QStompHeaderTable::valueAt(int i) const
+{
+	const int pos = this->m_entries.at(i).valuePos;
+	if (pos < 0)
+		return this->m_shared.at(-pos - 1);
+	if (this->m_views)
+		return QByteArray::fromRawData(this->valueData(i), this->valueLength(i));
+	return QByteArray(this->valueData(i), this->valueLength(i));
+}
+
+int QStompHeaderTable::indexOf(const char * key, int length, int from) const
+{
+	// Well-known keys are answered straight from their slot
+	if (from <= 0) {
+		int known = knownHeaderForName(key, length);
+		if (known != -1)
+			return this->m_known[known];
+	}
+
+	const uint hash = foldedHash(key, length);
+	for (int i = qMax(from, 0); i < this->m_entries.size(); i++) {
+		const QStompHeaderEntry &e = this->m_entries.at(i);
+		if (e.keyHash == hash && e.keyLength == length && foldedEquals(this->data(e.keyPos), key, length))
+			return i;
+	}
+	return -1;
+}
+
+void QStompHeaderTable::append(const char * key, int keyLength, const char * value, int valueLength)
+{
+	QStompHeaderEntry e;
+	e.keyHash = foldedHash(key, keyLength);
+	e.known = knownHeaderForName(key, keyLength);
+	e.keyPos = this->store(key, keyLength);
+	e.keyLength = keyLength;
+	e.valuePos = this->store(value, valueLength);
+	e.valueLength = valueLength;
+	this->appendEntry(e);
+}
+
+void QStompHeaderTable::appendSpan(const QStompHeaderSpan &span)
+{
+	QStompHeaderEntry e;
+	e.keyPos = span.keyPos;
+	e.keyLength = span.keyLength;
+	e.valuePos = span.valuePos;
+	e.valueLength = span.valueLength;
+	e.keyHash = foldedHash(this->m_arena.constData() + span.keyPos, span.keyLength);
+	e.known = knownHeaderForName(this->m_arena.constData() + span.keyPos, span.keyLength);
+	this->appendEntry(e);
+}
+
+void QStompHeaderTable::appendShared(const QByteArray &key, const QByteArray &value)
+{
+	QStompHeaderEntry e;
+	e.keyHash = foldedHash(key.constData(), key.size());
+	e.known = knownHeaderForName(key.constData(), key.size());
+	e.keyPos = this->share(key);
+	e.keyLength = key.size();
+	e.valuePos = this->share(value);
+	e.valueLength = value.size();
+	this->appendEntry(e);
+}
+
+void QStompHeaderTable::appendShared(const QByteArray &key, const char * value, int valueLength)
+{
+	QStompHeaderEntry e;
+	e.keyHash = foldedHash(key.constData(), key.size());
+	e.known = knownHeaderForName(key.constData(), key.size());
+	e.keyPos = this->share(key);
+	e.keyLength = key.size();
+	e.valuePos = this->store(value, valueLength);
+	e.valueLength = valueLength;
+	this->appendEntry(e);
+}
+
+int QStompHeaderTable::share(const QByteArray &bytes)
+{
+	this->m_shared.append(bytes);
+	return -this->m_shared.size();
+}
+
+void QStompHeaderTable::appendEntry(const QStompHeaderEntry &e)
+{
+	this->m_entries.append(e);
+	if (e.known != -1 && this->m_known[e.known] == -1) {
+		this->m_known[e.known] = this->m_entries.size() - 1;
+		if (e.known == QStompHeaderTable::HeaderContentLength)
+			this->updateContentLength();
+	}
+}
+
+QByteArray QStompHeaderTable::value(QStompHeaderTable::KnownHeader header) const
+{
+	int i = this->m_known[header];
+	if (i == -1)
+		return QByteArray();
+	return this->valueAt(i);
+}
+
+void QStompHeaderTable::setValue(QStompHeaderTable::KnownHeader header, const QByteArray &value)
+{
+	int i = this->m_known[header];
+	if (i != -1)
+		this->setValueAt(i, value);
+	else
+		this->append(HEADER_NAMES[header].name, HEADER_NAMES[header].length, value.constData(), value.size());
+}
+
+void QStompHeaderTable::resetKnown()
+{
+	for (int h = 0; h < QStompHeaderTable::KnownHeaderCount; h++)
+		this->m_known[h] = -1;
+	this->m_contentLength = 0;
+}
+
+void QStompHeaderTable::updateContentLength()
+{
+	int i = this->m_known[QStompHeaderTable::HeaderContentLength];
+	if (i == -1)
+		this->m_contentLength = 0;
+	else
+		this->m_contentLength = QByteArray::fromRawData(this->valueData(i), this->valueLength(i)).toUInt();
+}
+
+void QStompHeaderTable::setValueAt(int i, const QByteArray &value)
+{
+	int pos = this->store(value.constData(), value.size());
+	QStompHeaderEntry &e = this->m_entries[i];
+	if (e.valuePos >= 0)
+		this->m_garbage += e.valueLength;
+	e.valuePos = pos;
+	e.valueLength = value.size();
+	if (e.known == QStompHeaderTable::HeaderContentLength && this->m_known[e.known] == i)
+		this->updateContentLength();
+	this->squeezeIfWasteful();
+}
+
+void QStompHeaderTable::removeAt(int i)
+{
+	const QStompHeaderEntry &e = this->m_entries.at(i);
+	const int known = e.known;
+	if (e.keyPos >= 0)
+		this->m_garbage += e.keyLength;
+	if (e.valuePos >= 0)
+		this->m_garbage += e.valueLength;
+	this->m_entries.remove(i);
+	if (this->m_entries.isEmpty()) {
+		this->clear();
+		return;
+	}
+
+	// Shift the slots behind the removed entry; if it filled a slot itself,
+	// the next entry with the same key takes over
+	for (int h = 0; h < QStompHeaderTable::KnownHeaderCount; h++) {
+		if (this->m_known[h] > i)
+			this->m_known[h]--;
+	}
+	if (known != -1 && this->m_known[known] == i) {
+		this->m_known[known] = -1;
+		for (int j = i; j < this->m_entries.size(); j++) {
+			if (this->m_entries.at(j).known == known) {
+				this->m_known[known] = j;
+				break;
+			}
+		}
+		if (known == QStompHeaderTable::HeaderContentLength)
+			this->updateContentLength();
+	}
+	this->squeezeIfWasteful();
+}
+
+void QStompHeaderTable::clear()
+{
+	this->m_arena.clear();
+	this->m_entries.clear();
+	this->m_shared.clear();
+	this->m_garbage = 0;
+	this->m_borrowed = false;
+	this->m_views = false;
+	this->resetKnown();
+}
+
+void QStompHeaderTable::setSource(const QByteArray &data, bool views)
+{
+	this->m_arena = data;
+	this->m_entries.clear();
+	this->m_shared.clear();
+	this->resetKnown();
+	this->m_garbage = 0;
+	this->m_borrowed = true;
+	this->m_views = views;
+}
+
+QStompHeaderList QStompHeaderTable::toList() const
+{
+	QStompHeaderList list;
+	list.reserve(this->m_entries.size());
+	for (int i = 0; i < this->m_entries.size(); i++)
+		list.append(qMakePair(this->keyAt(i), this->valueAt(i)));
+	return list;
+}
+
+void QStompHeaderTable::setList(const QStompHeaderList &list)
+{
+	this->clear();
+	this->m_entries.reserve(list.size());
+	QStompHeaderList::ConstIterator it = list.constBegin();
+	while (it != list.constEnd()) {
+		this->append((*it).first, (*it).second);
+		++it;
+	}
+}
+
+int QStompHeaderTable::store(const char * data, int length)
+{
+	const char * arena = this->m_arena.constData();
+	if (data >= arena && data < arena + this->m_arena.size()) {
+		// The bytes live in the arena itself (e.g. a view handed out
+		// earlier), so copy them before the arena may reallocate
+		QByteArray copy(data, length);
+		return this->store(copy.constData(), length);
+	}
+
+	// A borrowed arena is the whole received frame; rather than detaching
+	// all of it, start a private arena holding just the header fields
+	if (this->m_borrowed)
+		this->squeeze();
+
+	int pos = this->m_arena.size();
+	this->m_arena.append(data, length);
+	return pos;
+}
+
+void QStompHeaderTable::squeezeIfWasteful()
+{
+	if (this->m_garbage >= 256 && this->m_garbage >= this->m_arena.size() / 2)
+		this->squeeze();
+}
+
+void QStompHeaderTable::squeeze()
+{
+	int live = 0;
+	for (int i = 0; i < this->m_entries.size(); i++)
+		live += this->m_entries.at(i).keyLength + this->m_entries.at(i).valueLength;
+
+	// Shared strings stay where they are, only arena bytes are moved
+	QByteArray arena;
+	arena.reserve(live);
+	QVector<QStompHeaderEntry>::Iterator it = this->m_entries.begin();
+	while (it != this->m_entries.end()) {
+		if ((*it).keyPos >= 0) {
+			int keyPos = arena.size();
+			arena.append(this->m_arena.constData() + (*it).keyPos, (*it).keyLength);
+			(*it).keyPos = keyPos;
+		}
+		if ((*it).valuePos >= 0) {
+			int valuePos = arena.size();
+			arena.append(this->m_arena.constData() + (*it).valuePos, (*it).valueLength);
+			(*it).valuePos = valuePos;
+		}
+		++it;
+	}
+	this->m_arena = arena;
+	this->m_garbage = 0;
+	this->m_borrowed = false;
+	// The arena is private and reallocated on change from now on, views
+	// into it would dangle
+	this->m_views = false;
+}
+
+
+QStompPublisher::QStompPublisher(QStompClient * client, const QByteArray &destination, const QStompHeaderList &headers) : pd_ptr(new QStompPublisherPrivate)
+{
+	P_D(QStompPublisher);
+	d->m_client = client;
+	d->m_destination = destination;
+	d->m_headers = headers;
+	if (client == NULL) {
+		// Every send fails
+		qWarning("QStompPublisher: No client given");
+		d->m_textCodec = defaultTextCodec();
+		return;
+	}
+	d->m_textCodec = QStompClientPrivate::get(client)->m_textCodec;
+
+	// Build the frame the way QStompClient::send() would and keep its head
+	QStompRequestFrame frame(QStompRequestFrame::RequestSend);
+	frame.setHeaderValues(headers);
+	frame.setContentEncoding(d->m_textCodec);
+	frame.setDestination(destination);
+	QStompRequestFramePrivate::get(frame)->writeHead(d->m_template, COMMAND_NAMES[CommandSend].name, COMMAND_NAMES[CommandSend].length);
+	d->m_template.chop(1);
+
+	// Raw bodies are sent like QStompClient::send() sends them: no
+	// content-encoding, content-length filled in per message
+	QStompRequestFrame rawFrame(QStompRequestFrame::RequestSend);
+	rawFrame.setHeaderValues(headers);
+	rawFrame.removeAllHeaderValues(QByteArray(HEADER_NAMES[QStompHeaderTable::HeaderContentLength].name));
+	rawFrame.setDestination(destination);
+	QStompRequestFramePrivate::get(rawFrame)->writeHead(d->m_rawTemplate, COMMAND_NAMES[CommandSend].name, COMMAND_NAMES[CommandSend].length);
+	d->m_rawTemplate.chop(1);
+
+	const QList<QByteArray> keys = frame.headerKeys() + rawFrame.headerKeys();
+	for (int i = 0; i < keys.size(); i++)
+		d->m_templateKeys.insert(keys.at(i).toLower());
+	d->m_templateKeys.insert(QByteArray(HEADER_NAMES[QStompHeaderTable::HeaderContentLength].name));
+	d->m_templateKeys.insert(QByteArray(HEADER_NAMES[QStompHeaderTable::HeaderTransaction].name));
+}
+
+QStompPublisher::~QStompPublisher()
+{
+	delete this->pd_ptr;
+}
+
+QStompClient * QStompPublisher::client() const
+{
+	const P_D(QStompPublisher);
+	return d->m_client;
+}
+
+QByteArray QStompPublisher::destination() const
+{
+	const P_D(QStompPublisher);
+	return d->m_destination;
+}
+
+static inline void appendHeaderLine(QByteArray &out, const char * key, int keyLength, const QByteArray &value)
+{
+	out.append(key, keyLength);
+	out.append(": ", 2);
+	out.append(value);
+	out.append('\n');
+}
+
+bool QStompPublisher::send(const QString &body, const QByteArray &transactionId, const QStompHeaderList &headers)
+{
+	P_D(QStompPublisher);
+	return d->send(d->m_textCodec->fromUnicode(body), false, transactionId, headers);
+}
+
+bool QStompPublisher::sendBytes(const QByteArray &rawBody, const QByteArray &transactionId, const QStompHeaderList &headers)
+{
+	P_D(QStompPublisher);
+	return d->send(rawBody, true, transactionId, headers);
+}
+
+bool QStompPublisherPrivate::overridesTemplate(const QStompHeaderList &headers) const
+{
+	for (int i = 0; i < headers.size(); i++) {
+		if (this->m_templateKeys.contains(headers.at(i).first.toLower()))
+			return true;
+	}
+	return false;
+}
+
+bool QStompPublisherPrivate::send(const QByteArray &body, bool withLength, const QByteArray &transactionId, const QStompHeaderList &headers)
+{
+	if (this->m_client.isNull())
+		return false;
+	QStompClientPrivate * cd = QStompClientPrivate::get(this->m_client);
+	QByteArray &head = cd->m_scratch;
+	head.resize(0);
+
+	if (this->overridesTemplate(headers)) {
+		// A per-message header replaces one of the template, build the
+		// whole head the slow way
+		QStompRequestFrame frame(QStompRequestFrame::RequestSend);
+		frame.setHeaderValues(this->m_headers);
+		if (withLength)
+			frame.removeAllHeaderValues(QByteArray(HEADER_NAMES[QStompHeaderTable::HeaderContentLength].name));
+		else
+			frame.setContentEncoding(this->m_textCodec);
+		frame.setDestination(this->m_destination);
+		if (!transactionId.isNull())
+			frame.setTransactionId(transactionId);
+		for (int i = 0; i < headers.size(); i++)
+			frame.setHeaderValue(headers.at(i).first, headers.at(i).second);
+		if (withLength)
+			frame.setContentLength(body.size());
+		QStompRequestFramePrivate::get(frame)->writeHead(head, COMMAND_NAMES[CommandSend].name, COMMAND_NAMES[CommandSend].length);
+		return cd->writeSegments(head, body);
+	}
+
+	// Only the per-message lines are serialized here
+	head.append(withLength ? this->m_rawTemplate : this->m_template);
+	if (withLength)
+		appendHeaderLine(head, HEADER_NAMES[QStompHeaderTable::HeaderContentLength].name, HEADER_NAMES[QStompHeaderTable::HeaderContentLength].length, QByteArray::number(body.size()));
+	if (!transactionId.isNull())
+		appendHeaderLine(head, HEADER_NAMES[QStompHeaderTable::HeaderTransaction].name, HEADER_NAMES[QStompHeaderTable::HeaderTransaction].length, transactionId);
+	for (int i = 0; i < headers.size(); i++)
+		appendHeaderLine(head, headers.at(i).first.constData(), headers.at(i).first.size(), headers.at(i).second);
+	head.append('\n');
+
+	return cd->writeSegments(head, body);
+}
+
+
+// Never dereferenced, only its address marks a closed queue
+static char producerQueueClosed;
+
+QStompProducerQueue::~QStompProducerQueue()
+{
+	QStompProducerNode * node = qstompLoadAcquire(this->m_top);
+	if (node == closedMark())
+		return;
+	while (node != NULL) {
+		QStompProducerNode * next = node->next;
+		delete node;
+		node = next;
+	}
+}
+
+QStompProducerNode * QStompProducerQueue::closedMark()
+{
+	return reinterpret_cast<QStompProducerNode *>(&producerQueueClosed);
+}
+
+QStompProducerNode * QStompProducerQueue::reverse(QStompProducerNode * node)
+{
+	QStompProducerNode * first = NULL;
+	while (node != NULL) {
+		QStompProducerNode * next = node->next;
+		node->next = first;
+		first = node;
+		node = next;
+	}
+	return first;
+}
+
+bool QStompProducerQueue::push(QStompProducerNode * node)
+{
+	QStompProducerNode * top;
+	do {
+		top = qstompLoadAcquire(this->m_top);
+		if (top == closedMark())
+			return false;
+		node->next = top;
+	} while (!this->m_top.testAndSetRelease(top, node));
+
+	// Only a push onto an empty stack wakes the client, everything pushed
+	// after it is picked up by the same drain
+	if (top == NULL) {
+		QMutexLocker locker(&this->m_mutex);
+		if (this->m_client != NULL)
+			QMetaObject::invokeMethod(this->m_client, "_q_drainProducers", Qt::QueuedConnection);
+	}
+	return true;
+}
+
+QStompProducerNode * QStompProducerQueue::takeAll()
+{
+	// The mark stays in place, a closed queue has nothing left to take
+	QStompProducerNode * top;
+	do {
+		top = qstompLoadAcquire(this->m_top);
+		if (top == NULL || top == closedMark())
+			return NULL;
+	} while (!this->m_top.testAndSetAcquire(top, NULL));
+	return reverse(top);
+}
+
+QStompProducerNode * QStompProducerQueue::close()
+{
+	QStompProducerNode * top = this->m_top.fetchAndStoreOrdered(closedMark());
+	QMutexLocker locker(&this->m_mutex);
+	this->m_client = NULL;
+	return top == closedMark() ? NULL : reverse(top);
+}
+
+void QStompClientPrivate::_q_drainProducers()
+{
+	P_Q(QStompClient);
+	if (!this->m_producerQueue)
+		return;
+	const int rejected = this->sendProducerNodes(this->m_producerQueue->takeAll());
+	if (rejected > 0)
+		emit q->producerFramesRejected(rejected);
+}
+
+// Sends and frees the nodes, returns how many frames the client refused
+int QStompClientPrivate::sendProducerNodes(QStompProducerNode * node)
+{
+	P_Q(QStompClient);
+	int rejected = 0;
+	while (node != NULL) {
+		if (node->batchable && this->m_batching)
+			this->batchSend(node->frame);
+		else if (!q->sendFrame(node->frame))
+			rejected++;
+		QStompProducerNode * next = node->next;
+		delete node;
+		node = next;
+	}
+	return rejected;
+}
+
+
+QStompProducer::QStompProducer(QStompClient * client) : pd_ptr(new QStompProducerPrivate)
+{
+	P_D(QStompProducer);
+	if (client == NULL) {
+		// Every send fails
+		qWarning("QStompProducer: No client given");
+		d->m_textCodec = defaultTextCodec();
+		return;
+	}
+	QStompClientPrivate * cd = QStompClientPrivate::get(client);
+	if (!cd->m_producerQueue)
+		cd->m_producerQueue = new QStompProducerQueue(client);
+	d->m_queue = cd->m_producerQueue;
+	d->m_textCodec = cd->m_textCodec;
+}
+
+QStompProducer::~QStompProducer()
+{
+	delete this->pd_ptr;
+}
+
+bool QStompProducer::isOpen() const
+{
+	const P_D(QStompProducer);
+	return d->m_queue && !d->m_queue->isClosed();
+}
+
+bool QStompProducer::sendFrame(const QStompRequestFrame &frame)
+{
+	P_D(QStompProducer);
+	return d->enqueue(frame, false);
+}
+
+bool QStompProducer::send(const QByteArray &destination, const QString &body, const QByteArray &transactionId, const QStompHeaderList &headers)
+{
+	P_D(QStompProducer);
+	QStompRequestFrame frame(QStompRequestFrame::RequestSend);
+	frame.setHeaderValues(headers);
+	frame.setContentEncoding(d->m_textCodec);
+	frame.setDestination(destination);
+	frame.setBody(body);
+	if (!transactionId.isNull())
+		frame.setTransactionId(transactionId);
+	return d->enqueue(frame, transactionId.isNull());
+}
+
+bool QStompProducer::sendBytes(const QByteArray &destination, const QByteArray &rawBody, const QByteArray &transactionId, const QStompHeaderList &headers)
+{
+	P_D(QStompProducer);
+	QStompRequestFrame frame(QStompRequestFrame::RequestSend);
+	frame.setHeaderValues(headers);
+	frame.setDestination(destination);
+	frame.setContentLength(rawBody.size());
+	frame.setRawBody(rawBody);
+	if (!transactionId.isNull())
+		frame.setTransactionId(transactionId);
+	return d->enqueue(frame, transactionId.isNull());
+}
+
+bool QStompProducerPrivate::enqueue(const QStompRequestFrame &frame, bool batchable)
+{
+	if (!this->m_queue || !frame.isValid())
+		return false;
+	QStompProducerNode * node = new QStompProducerNode;
+	node->frame = frame;
+	node->batchable = batchable;
+	if (!this->m_queue->push(node)) {
+		delete node;
+		return false;
+	}
+	return true;
+}
+
+
+QStompDestinationRouter::QStompDestinationRouter() : pd_ptr(new QStompDestinationRouterPrivate)
+{
+}
+
+QStompDestinationRouter::~QStompDestinationRouter()
+{
+	delete this->pd_ptr;
+}
+
+static inline bool isRouteSeparator(char c)
+{
+	return c == '.' || c == '/';
+}
+
+QList<QStompMessageHandler *> * QStompDestinationRouterPrivate::routeList(const QByteArray &pattern, bool create)
+{
+	QStompRouteNode * node = &this->m_root;
+	const char * data = pattern.constData();
+	const int size = pattern.size();
+	int pos = 0;
+	forever {
+		int end = pos;
+		while (end < size && !isRouteSeparator(data[end]))
+			end++;
+		const int length = end - pos;
+
+		if (length == 1 && data[pos] == '>' && end == size)
+			return &node->tailHandlers;
+
+		QStompRouteNode * next;
+		if (length == 1 && data[pos] == '*') {
+			if (node->any == NULL && create)
+				node->any = new QStompRouteNode;
+			next = node->any;
+		}
+		else {
+			QByteArray segment(data + pos, length);
+			next = node->children.value(segment);
+			if (next == NULL && create) {
+				next = new QStompRouteNode;
+				node->children.insert(segment, next);
+			}
+		}
+		if (next == NULL)
+			return NULL;
+		node = next;
+
+		if (end == size)
+			return &node->handlers;
+		pos = end + 1;
+	}
+}
+
+// Removes the route below the node, and the nodes it leaves empty on the way
+// back up so dispatch does not walk dead branches
+bool QStompDestinationRouterPrivate::removeRoute(QStompRouteNode * node, const QByteArray &pattern, int pos, QStompMessageHandler * handler)
+{
+	const char * data = pattern.constData();
+	const int size = pattern.size();
+	int end = pos;
+	while (end < size && !isRouteSeparator(data[end]))
+		end++;
+	const int length = end - pos;
+
+	if (length == 1 && data[pos] == '>' && end == size)
+		return node->tailHandlers.removeOne(handler);
+
+	const bool any = (length == 1 && data[pos] == '*');
+	const QByteArray segment = (any ? QByteArray() : QByteArray(data + pos, length));
+	QStompRouteNode * child = (any ? node->any : node->children.value(segment));
+	if (child == NULL)
+		return false;
+
+	bool removed;
+	if (end == size)
+		removed = child->handlers.removeOne(handler);
+	else
+		removed = this->removeRoute(child, pattern, end + 1, handler);
+	if (removed && child->isEmpty()) {
+		if (any)
+			node->any = NULL;
+		else
+			node->children.remove(segment);
+		delete child;
+	}
+	return removed;
+}
+
+// Adds the handler unless an overlapping route already matched it
+static inline void appendHandler(QVarLengthArray<QStompMessageHandler *, 16> &out, QStompMessageHandler * handler)
+{
+	for (int i = 0; i < out.size(); i++) {
+		if (out[i] == handler)
+			return;
+	}
+	out.append(handler);
+}
+
+void QStompDestinationRouterPrivate::collect(const QByteArray &destination, QVarLengthArray<QStompMessageHandler *, 16> &out) const
+{
+	// Walk all trie paths matching the destination side by side, there is
+	// more than one only where '*' routes branch off
+	QVarLengthArray<const QStompRouteNode *, 16> current;
+	QVarLengthArray<const QStompRouteNode *, 16> next;
+	current.append(&this->m_root);
+
+	const char * data = destination.constData();
+	const int size = destination.size();
+	int pos = 0;
+	forever {
+		int end = pos;
+		while (end < size && !isRouteSeparator(data[end]))
+			end++;
+		const QByteArray segment = QByteArray::fromRawData(data + pos, end - pos);
+
+		next.clear();
+		for (int i = 0; i < current.size(); i++) {
+			const QStompRouteNode * node = current[i];
+			for (int j = 0; j < node->tailHandlers.size(); j++)
+				appendHandler(out, node->tailHandlers.at(j));
+			const QStompRouteNode * child = node->children.value(segment);
+			if (child != NULL)
+				next.append(child);
+			if (node->any != NULL)
+				next.append(node->any);
+		}
+		current = next;
+
+		if (end >= size || current.isEmpty())
+			break;
+		pos = end + 1;
+	}
+
+	for (int i = 0; i < current.size(); i++) {
+		const QStompRouteNode * node = current[i];
+		for (int j = 0; j < node->handlers.size(); j++)
+			appendHandler(out, node->handlers.at(j));
+	}
+}
+
+void QStompDestinationRouter::addRoute(const QByteArray &pattern, QStompMessageHandler * handler)
+{
+	P_D(QStompDestinationRouter);
+	d->routeList(pattern, true)->append(handler);
+	d->m_count++;
+}
+
+void QStompDestinationRouter::removeRoute(const QByteArray &pattern, QStompMessageHandler * handler)
+{
+	P_D(QStompDestinationRouter);
+	if (d->removeRoute(&d->m_root, pattern, 0, handler))
+		d->m_count--;
+}
+
+void QStompDestinationRouter::clear()
+{
+	P_D(QStompDestinationRouter);
+	qDeleteAll(d->m_root.children);
+	d->m_root.children.clear();
+	delete d->m_root.any;
+	d->m_root.any = NULL;
+	d->m_root.handlers.clear();
+	d->m_root.tailHandlers.clear();
+	d->m_count = 0;
+}
+
+int QStompDestinationRouter::routeCount() const
+{
+	const P_D(QStompDestinationRouter);
+	return d->m_count;
+}
+
+QList<QStompMessageHandler *> QStompDestinationRouter::match(const QByteArray &destination) const
+{
+	const P_D(QStompDestinationRouter);
+	QVarLengthArray<QStompMessageHandler *, 16> handlers;
+	d->collect(destination, handlers);
+	QList<QStompMessageHandler *> ret;
+	for (int i = 0; i < handlers.size(); i++)
+		ret.append(handlers[i]);
+	return ret;
+}
+
+void QStompDestinationRouter::handleMessage(const QStompResponseFrame &frame)
+{
+	P_D(QStompDestinationRouter);
+	QVarLengthArray<QStompMessageHandler *, 16> handlers;
+	d->collect(frame.destination(), handlers);
+	for (int i = 0; i < handlers.size(); i++)
+		handlers[i]->handleMessage(frame);
+}
+
+
+QStompConsumerGroup::QStompConsumerGroup(int connections, QObject *parent) : QObject(parent), pd_ptr(new QStompConsumerGroupPrivate(this))
+{
+	P_D(QStompConsumerGroup);
+	qRegisterMetaType<QStompHeaderList>("QStompHeaderList");
+	qRegisterMetaType<QAbstractSocket::SocketState>("QAbstractSocket::SocketState");
+
+	connections = qMax(connections, 1);
+	d->m_load.fill(0, connections);
+	for (int i = 0; i < connections; i++) {
+		QThread * thread = new QThread();
+		thread->setObjectName(QString::fromLatin1("QStomp consumer %1").arg(i));
+		QStompGroupMember * member = new QStompGroupMember(d, i);
+		member->moveToThread(thread);
+		connect(member, SIGNAL(stateChanged(int, QAbstractSocket::SocketState)), this, SIGNAL(connectionStateChanged(int, QAbstractSocket::SocketState)));
+		connect(member, SIGNAL(subscribeFailed(int, QByteArray)), this, SLOT(_q_subscribeFailed(int, QByteArray)));
+		thread->start();
+		d->m_threads.append(thread);
+		d->m_members.append(member);
+	}
+}
+
+QStompConsumerGroup::~QStompConsumerGroup()
+{
+	P_D(QStompConsumerGroup);
+	// Each client has to go on its own thread
+	for (int i = 0; i < d->m_members.size(); i++) {
+		QMetaObject::invokeMethod(d->m_members.at(i), "shutdown", Qt::BlockingQueuedConnection);
+		d->m_threads.at(i)->quit();
+		d->m_threads.at(i)->wait();
+		delete d->m_members.at(i);
+		delete d->m_threads.at(i);
+	}
+	delete this->pd_ptr;
+}
+
+int QStompConsumerGroup::connectionCount() const
+{
+	const P_D(QStompConsumerGroup);
+	return d->m_members.size();
+}
+
+QStompMessageHandler * QStompConsumerGroup::handler() const
+{
+	const P_D(QStompConsumerGroup);
+	return qstompLoadAcquire(d->m_handler);
+}
+
+void QStompConsumerGroup::setHandler(QStompMessageHandler * handler)
+{
+	P_D(QStompConsumerGroup);
+	d->m_handler.fetchAndStoreRelease(handler);
+}
+
+void QStompConsumerGroup::connectToHost(const QString &hostname, quint16 port)
+{
+	P_D(QStompConsumerGroup);
+	for (int i = 0; i < d->m_members.size(); i++)
+		QMetaObject::invokeMethod(d->m_members.at(i), "connectToHost", Qt::QueuedConnection, Q_ARG(QString, hostname), Q_ARG(quint16, port));
+}
+
+void QStompConsumerGroup::login(const QByteArray &user, const QByteArray &password)
+{
+	P_D(QStompConsumerGroup);
+	for (int i = 0; i < d->m_members.size(); i++)
+		QMetaObject::invokeMethod(d->m_members.at(i), "login", Qt::QueuedConnection, Q_ARG(QByteArray, user), Q_ARG(QByteArray, password));
+}
+
+void QStompConsumerGroup::subscribe(const QByteArray &destination, SubscriptionMode mode, bool autoAck, const QStompHeaderList &headers)
+{
+	P_D(QStompConsumerGroup);
+	QList<int> &members = d->m_subscriptions[destination];
+	// A distributed destination stays on the connection it already has,
+	// a second one would get every message again
+	if (mode == QStompConsumerGroup::DistributeSubscriptions && !members.isEmpty())
+		return;
+	QList<int> targets;
+	if (mode == QStompConsumerGroup::CompetingConsumers) {
+		for (int i = 0; i < d->m_members.size(); i++)
+			targets.append(i);
+	}
+	else {
+		int least = 0;
+		for (int i = 1; i < d->m_load.size(); i++) {
+			if (d->m_load.at(i) < d->m_load.at(least))
+				least = i;
+		}
+		targets.append(least);
+	}
+
+	for (int i = 0; i < targets.size(); i++) {
+		const int index = targets.at(i);
+		if (members.contains(index))
+			continue;
+		members.append(index);
+		d->m_load[index]++;
+		QMetaObject::invokeMethod(d->m_members.at(index), "subscribe", Qt::QueuedConnection, Q_ARG(QByteArray, destination), Q_ARG(bool, autoAck), Q_ARG(QStompHeaderList, headers));
+	}
+}
+
+void QStompConsumerGroup::unsubscribe(const QByteArray &destination)
+{
+	P_D(QStompConsumerGroup);
+	const QList<int> members = d->m_subscriptions.take(destination);
+	for (int i = 0; i < members.size(); i++) {
+		d->m_load[members.at(i)]--;
+		QMetaObject::invokeMethod(d->m_members.at(members.at(i)), "unsubscribe", Qt::QueuedConnection, Q_ARG(QByteArray, destination));
+	}
+}
+
+QStompConsumerGroup::Stats QStompConsumerGroup::stats() const
+{
+	const P_D(QStompConsumerGroup);
+	Stats total;
+	total.messages = 0;
+	total.bytes = 0;
+	total.errors = 0;
+	total.connected = 0;
+	for (int i = 0; i < d->m_members.size(); i++) {
+		const Stats stats = d->m_members.at(i)->stats();
+		total.messages += stats.messages;
+		total.bytes += stats.bytes;
+		total.errors += stats.errors;
+		total.connected += stats.connected;
+	}
+	return total;
+}
+
+QStompConsumerGroup::Stats QStompConsumerGroup::stats(int connection) const
+{
+	const P_D(QStompConsumerGroup);
+	return d->m_members.at(connection)->stats();
+}
+
+void QStompConsumerGroup::disconnectFromHost()
+{
+	P_D(QStompConsumerGroup);
+	for (int i = 0; i < d->m_members.size(); i++)
+		QMetaObject::invokeMethod(d->m_members.at(i), "disconnectFromHost", Qt::QueuedConnection);
+}
+
+void QStompConsumerGroupPrivate::_q_subscribeFailed(int connection, const QByteArray &destination)
+{
+	P_Q(QStompConsumerGroup);
+	// Already gone if the destination was unsubscribed in the meantime
+	QHash<QByteArray, QList<int> >::iterator it = this->m_subscriptions.find(destination);
+	if (it != this->m_subscriptions.end() && it.value().removeOne(connection)) {
+		this->m_load[connection]--;
+		if (it.value().isEmpty())
+			this->m_subscriptions.erase(it);
+	}
+	emit q->subscriptionFailed(connection, destination);
+}
+
+
+QStompGroupMember::QStompGroupMember(QStompConsumerGroupPrivate * group, int index) : m_group(group), m_index(index)
+{
+	this->m_stats.messages = 0;
+	this->m_stats.bytes = 0;
+	this->m_stats.errors = 0;
+	this->m_stats.connected = 0;
+
+	// Moves to the member's thread along with it
+	this->m_client = new QStompClient(this);
+	connect(this->m_client, SIGNAL(socketStateChanged(QAbstractSocket::SocketState)), this, SLOT(clientStateChanged(QAbstractSocket::SocketState)));
+	connect(this->m_client, SIGNAL(frameReceived()), this, SLOT(framesReceived()));
+}
+
+QStompConsumerGroup::Stats QStompGroupMember::stats() const
+{
+	QMutexLocker locker(&this->m_mutex);
+	return this->m_stats;
+}
+
+void QStompGroupMember::handleMessage(const QStompResponseFrame &frame)
+{
+	QStompMessageHandler * handler = qstompLoadAcquire(this->m_group->m_handler);
+	if (handler != NULL)
+		handler->handleMessage(frame);
+	if (!this->m_clientAck.isEmpty() && this->m_clientAck.contains(frame.subscriptionId()))
+		this->m_client->ack(frame);
+
+	QMutexLocker locker(&this->m_mutex);
+	this->m_stats.messages++;
+	this->m_stats.bytes += frame.rawBody().size();
+}
+
+void QStompGroupMember::connectToHost(const QString &hostname, quint16 port)
+{
+	this->m_client->connectToHost(hostname, port);
+}
+
+void QStompGroupMember::login(const QByteArray &user, const QByteArray &password)
+{
+	this->m_client->login(user, password);
+}
+
+void QStompGroupMember::resubscribe()
+{
+	// The broker forgot the subscriptions along with the old connection
+	QList<QByteArray> failed;
+	QHash<QByteArray, QStompGroupSubscription>::iterator it;
+	for (it = this->m_subscriptions.begin(); it != this->m_subscriptions.end(); ++it) {
+		if (it.value().id.isNull() && !this->subscribeOnClient(it.key(), it.value()))
+			failed.append(it.key());
+	}
+	for (int i = 0; i < failed.size(); i++) {
+		this->m_subscriptions.remove(failed.at(i));
+		emit subscribeFailed(this->m_index, failed.at(i));
+	}
+}
+
+void QStompGroupMember::subscribe(const QByteArray &destination, bool autoAck, const QStompHeaderList &headers)
+{
+	QStompGroupSubscription subscription;
+	subscription.autoAck = autoAck;
+	subscription.headers = headers;
+	if (!this->subscribeOnClient(destination, subscription)) {
+		emit subscribeFailed(this->m_index, destination);
+		return;
+	}
+	this->m_subscriptions.insert(destination, subscription);
+}
+
+bool QStompGroupMember::subscribeOnClient(const QByteArray &destination, QStompGroupSubscription &subscription)
+{
+	subscription.id = this->m_client->subscribe(destination, subscription.autoAck, static_cast<QStompMessageHandler *>(this), subscription.headers);
+	if (subscription.id.isNull())
+		return false;
+	if (!subscription.autoAck)
+		this->m_clientAck.insert(subscription.id);
+	return true;
+}
+
+void QStompGroupMember::unsubscribe(const QByteArray &destination)
+{
+	const QByteArray id = this->m_subscriptions.take(destination).id;
+	if (id.isNull())
+		return;
+	this->m_clientAck.remove(id);
+	this->m_client->unsubscribeId(id);
+}
+
+void QStompGroupMember::disconnectFromHost()
+{
+	this->m_client->disconnectFromHost();
+}
+
+void QStompGroupMember::shutdown()
+{
+	delete this->m_client;
+	this->m_client = NULL;
+}
+
+void QStompGroupMember::clientStateChanged(QAbstractSocket::SocketState state)
+{
+	this->m_mutex.lock();
+	this->m_stats.connected = (state == QAbstractSocket::ConnectedState ? 1 : 0);
+	this->m_mutex.unlock();
+
+	// Drop the client's routes of the lost connection, the next CONNECTED
+	// frame subscribes again under new ids
+	if (state == QAbstractSocket::UnconnectedState && this->m_client != NULL) {
+		QHash<QByteArray, QStompGroupSubscription>::iterator it;
+		for (it = this->m_subscriptions.begin(); it != this->m_subscriptions.end(); ++it) {
+			if (!it.value().id.isNull())
+				this->m_client->unsubscribeId(it.value().id);
+			it.value().id = QByteArray();
+		}
+		this->m_clientAck.clear();
+	}
+	emit stateChanged(this->m_index, state);
+}
+
+void QStompGroupMember::framesReceived()
+{
+	// Messages go to the handler, whatever else arrives is only counted
+	const QList<QStompResponseFrame> frames = this->m_client->fetchAllFrames();
+	int errors = 0;
+	for (int i = 0; i < frames.size(); i++) {
+		if (frames.at(i).type() == QStompResponseFrame::ResponseError)
+			errors++;
+		else if (frames.at(i).type() == QStompResponseFrame::ResponseConnected)
+			this->resubscribe();
+	}
+	if (errors > 0) {
+		QMutexLocker locker(&this->m_mutex);
+		this->m_stats.errors += errors;
+	}
+}
+
+
+QStompOrderedExecutor::QStompOrderedExecutor(QStompClient * client, QStompMessageHandler * handler, int lanes, QObject *parent) : QObject(parent), pd_ptr(new QStompOrderedExecutorPrivate(this))
+{
+	P_D(QStompOrderedExecutor);
+	if (client != NULL && client->thread() != this->thread())
+		qWarning("QStompOrderedExecutor: Not on the client's thread, acks would race with it");
+	d->m_client = client;
+	d->m_handler = handler;
+	d->m_ackEnabled = true;
+	d->m_pool = QThreadPool::globalInstance();
+	if (lanes <= 0)
+		lanes = qMax(QThread::idealThreadCount(), 1) * 4;
+	for (int i = 0; i < lanes; i++)
+		d->m_lanes.append(new QStompExecutorLane());
+	d->m_maxInFlight = QSTOMP_EXECUTOR_IN_FLIGHT;
+	d->m_inFlight.release(d->m_maxInFlight);
+	d->m_tasks = 0;
+}
+
+QStompOrderedExecutor::~QStompOrderedExecutor()
+{
+	P_D(QStompOrderedExecutor);
+	this->waitForDone();
+	qDeleteAll(d->m_lanes);
+	delete this->pd_ptr;
+}
+
+QByteArray QStompOrderedExecutor::keyHeader() const
+{
+	const P_D(QStompOrderedExecutor);
+	return d->m_keyHeader;
+}
+
+void QStompOrderedExecutor::setKeyHeader(const QByteArray &name)
+{
+	P_D(QStompOrderedExecutor);
+	d->m_keyHeader = name;
+}
+
+int QStompOrderedExecutor::maxInFlight() const
+{
+	const P_D(QStompOrderedExecutor);
+	return d->m_maxInFlight;
+}
+
+void QStompOrderedExecutor::setMaxInFlight(int messages)
+{
+	P_D(QStompOrderedExecutor);
+	messages = qMax(messages, 1);
+	// Lowering the bound waits for enough messages to finish
+	if (messages > d->m_maxInFlight)
+		d->m_inFlight.release(messages - d->m_maxInFlight);
+	else if (messages < d->m_maxInFlight)
+		d->m_inFlight.acquire(d->m_maxInFlight - messages);
+	d->m_maxInFlight = messages;
+}
+
+bool QStompOrderedExecutor::isAckEnabled() const
+{
+	const P_D(QStompOrderedExecutor);
+	return d->m_ackEnabled;
+}
+
+void QStompOrderedExecutor::setAckEnabled(bool enabled)
+{
+	P_D(QStompOrderedExecutor);
+	d->m_ackEnabled = enabled;
+}
+
+QThreadPool * QStompOrderedExecutor::threadPool() const
+{
+	const P_D(QStompOrderedExecutor);
+	return d->m_pool;
+}
+
+void QStompOrderedExecutor::setThreadPool(QThreadPool * pool)
+{
+	P_D(QStompOrderedExecutor);
+	d->m_pool = (pool != NULL ? pool : QThreadPool::globalInstance());
+}
+
+int QStompOrderedExecutor::laneCount() const
+{
+	const P_D(QStompOrderedExecutor);
+	return d->m_lanes.size();
+}
+
+int QStompOrderedExecutor::inFlight() const
+{
+	const P_D(QStompOrderedExecutor);
+	return d->m_maxInFlight - d->m_inFlight.available();
+}
+
+bool QStompOrderedExecutor::waitForDone(int msecs)
+{
+	P_D(QStompOrderedExecutor);
+	if (msecs < 0)
+		d->m_inFlight.acquire(d->m_maxInFlight);
+	else if (!d->m_inFlight.tryAcquire(d->m_maxInFlight, msecs))
+		return false;
+	d->m_inFlight.release(d->m_maxInFlight);
+
+	d->m_taskMutex.lock();
+	while (d->m_tasks > 0)
+		d->m_tasksDone.wait(&d->m_taskMutex);
+	d->m_taskMutex.unlock();
+
+	d->_q_completed();
+	return true;
+}
+
+void QStompOrderedExecutor::handleMessage(const QStompResponseFrame &frame)
+{
+	P_D(QStompOrderedExecutor);
+	const QByteArray key = (d->m_keyHeader.isEmpty() ? frame.destination() : frame.headerValue(d->m_keyHeader));
+	QStompExecutorLane * lane = d->m_lanes.at(qHash(key) % uint(d->m_lanes.size()));
+
+	// Only cumulative acks have to wait for earlier messages
+	const quint64 sequence = QStompResponseFramePrivate::get(frame)->m_sequence;
+	if (d->m_ackEnabled && sequence != 0 && !d->m_client.isNull() && d->m_client->ackMode() == QStompClient::CumulativeAck) {
+		d->m_completedMutex.lock();
+		d->m_ackOrder[frame.subscriptionId()].insert(sequence, QStompResponseFrame());
+		d->m_completedMutex.unlock();
+	}
+
+	d->m_inFlight.acquire();
+	QMutexLocker locker(&lane->mutex);
+	lane->queue.append(frame);
+	if (!lane->running) {
+		lane->running = true;
+		d->startTask(lane);
+	}
+}
+
+void QStompLaneTask::run()
+{
+	for (int i = 0; i < QSTOMP_LANE_BATCH; i++) {
+		QStompResponseFrame frame;
+		{
+			QMutexLocker locker(&this->m_lane->mutex);
+			if (this->m_lane->queue.isEmpty()) {
+				this->m_lane->running = false;
+				break;
+			}
+			frame = this->m_lane->queue.takeFirst();
+		}
+		this->m_executor->m_handler->handleMessage(frame);
+		this->m_executor->complete(frame);
+		// Let other lanes have the thread, the lane stays owned by the
+		// next task
+		if (i + 1 == QSTOMP_LANE_BATCH)
+			this->m_executor->startTask(this->m_lane);
+	}
+	this->m_executor->finishTask();
+}
+
+void QStompOrderedExecutorPrivate::startTask(QStompExecutorLane * lane)
+{
+	this->m_taskMutex.lock();
+	this->m_tasks++;
+	this->m_taskMutex.unlock();
+	this->m_pool->start(new QStompLaneTask(this, lane));
+}
+
+void QStompOrderedExecutorPrivate::finishTask()
+{
+	QMutexLocker locker(&this->m_taskMutex);
+	if (--this->m_tasks == 0)
+		this->m_tasksDone.wakeAll();
+}
+
+void QStompOrderedExecutorPrivate::complete(const QStompResponseFrame &frame)
+{
+	P_Q(QStompOrderedExecutor);
+	this->m_completedMutex.lock();
+	const bool wake = this->m_completed.isEmpty();
+	this->m_completed.append(frame);
+	this->m_completedMutex.unlock();
+
+	// One wakeup for everything completed until the client thread gets to it
+	if (wake)
+		QMetaObject::invokeMethod(q, "_q_completed", Qt::QueuedConnection);
+	this->m_inFlight.release();
+}
+
+void QStompOrderedExecutorPrivate::_q_completed()
+{
+	QList<QStompResponseFrame> frames;
+	QList<QStompResponseFrame> acks;
+	this->m_completedMutex.lock();
+	qSwap(frames, this->m_completed);
+
+	// Lanes finish out of order. A cumulative ack also covers the messages
+	// received before it, so of a subscription only the latest message with
+	// none still running before it is acked.
+	for (int i = 0; i < frames.size(); i++) {
+		const QStompResponseFrame &frame = frames.at(i);
+		const quint64 sequence = QStompResponseFramePrivate::get(frame)->m_sequence;
+		QHash<QByteArray, QMap<quint64, QStompResponseFrame> >::iterator it = this->m_ackOrder.end();
+		if (sequence != 0 && !this->m_ackOrder.isEmpty())
+			it = this->m_ackOrder.find(frame.subscriptionId());
+		if (it == this->m_ackOrder.end() || !it.value().contains(sequence)) {
+			acks.append(frame);
+			continue;
+		}
+
+		QMap<quint64, QStompResponseFrame> &received = it.value();
+		received[sequence] = frame;
+		QStompResponseFrame latest;
+		while (!received.isEmpty() && received.begin().value().type() == QStompResponseFrame::ResponseMessage) {
+			latest = received.begin().value();
+			received.erase(received.begin());
+		}
+		if (latest.type() == QStompResponseFrame::ResponseMessage)
+			acks.append(latest);
+		if (received.isEmpty())
+			this->m_ackOrder.erase(it);
+	}
+	this->m_completedMutex.unlock();
+
+	// The client batches the acks themselves
+	if (!this->m_ackEnabled || this->m_client.isNull())
+		return;
+	for (int i = 0; i < acks.size(); i++)
+		this->m_client->ack(acks.at(i));
 }
@@ -36,12 +36,18 @@ class QStompFramePrivate;
 class QStompResponseFramePrivate;
 class QStompRequestFramePrivate;
 class QStompClientPrivate;
+class QStompPublisherPrivate;
+class QStompProducerPrivate;
+class QStompDestinationRouterPrivate;
+class QStompConsumerGroupPrivate;
+class QStompOrderedExecutorPrivate;
+class QThreadPool;
 
 typedef QList< QPair<QByteArray, QByteArray> > QStompHeaderList;
 
 class QSTOMP_SHARED_EXPORT QStompFrame
 {
-	P_DECLARE_PRIVATE(QStompFrame)
+	P_DECLARE_SHARED_PRIVATE(QStompFrame)
 public:
 	virtual ~QStompFrame();
 
@@ -85,14 +91,19 @@ protected:
 
 protected:
 	QStompFrame(QStompFramePrivate * d);
-	QStompFrame(const QStompFrame &other, QStompFramePrivate * d);
+	QStompFrame(const QStompFrame &other);
+#ifdef Q_COMPILER_RVALUE_REFS
+	QStompFrame(QStompFrame &&other);
+#endif
+	void share(const QStompFrame &other);
+	void detach();
 
-	QStompFramePrivate * const pd_ptr;
+	QStompFramePrivate * pd_ptr;
 };
 
 class QSTOMP_SHARED_EXPORT QStompResponseFrame : public QStompFrame
 {
-	P_DECLARE_PRIVATE(QStompResponseFrame)
+	P_DECLARE_SHARED_PRIVATE(QStompResponseFrame)
 public:
 	enum ResponseType {
 		ResponseInvalid = 0,
@@ -107,6 +118,11 @@ public:
 	QStompResponseFrame(const QByteArray &frame);
 	QStompResponseFrame(ResponseType type);
 	QStompResponseFrame &operator=(const QStompResponseFrame &other);
+#ifdef Q_COMPILER_RVALUE_REFS
+	QStompResponseFrame(QStompResponseFrame &&other);
+	inline QStompResponseFrame &operator=(QStompResponseFrame &&other) { swap(other); return *this; }
+#endif
+	inline void swap(QStompResponseFrame &other) { qSwap(pd_ptr, other.pd_ptr); }
 
 	void setType(ResponseType type);
 	ResponseType type() const;
@@ -139,7 +155,7 @@ protected:
 
 class QSTOMP_SHARED_EXPORT QStompRequestFrame : public QStompFrame
 {
-	P_DECLARE_PRIVATE(QStompRequestFrame)
+	P_DECLARE_SHARED_PRIVATE(QStompRequestFrame)
 public:
 	enum RequestType {
 		RequestInvalid = 0,
@@ -163,6 +179,11 @@ public:
 	QStompRequestFrame(const QByteArray &frame);
 	QStompRequestFrame(RequestType type);
 	QStompRequestFrame &operator=(const QStompRequestFrame &other);
+#ifdef Q_COMPILER_RVALUE_REFS
+	QStompRequestFrame(QStompRequestFrame &&other);
+	inline QStompRequestFrame &operator=(QStompRequestFrame &&other) { swap(other); return *this; }
+#endif
+	inline void swap(QStompRequestFrame &other) { qSwap(pd_ptr, other.pd_ptr); }
 
 	void setType(RequestType type);
 	RequestType type() const;
@@ -197,6 +218,13 @@ protected:
 	bool parseHeaderLine(const QByteArray &line, int number);
 };
 
+class QSTOMP_SHARED_EXPORT QStompMessageHandler
+{
+public:
+	virtual ~QStompMessageHandler() {}
+	virtual void handleMessage(const QStompResponseFrame &frame) = 0;
+};
+
 class QSTOMP_SHARED_EXPORT QStompClient : public QObject
 {
 	Q_OBJECT
@@ -214,22 +242,73 @@ public:
 		UnexpectedClose
 	};
 
+	enum TransferProfile {
+		BalancedTransfer,
+		LowLatencyTransfer,
+		HighThroughputTransfer
+	};
+
+	enum AckMode {
+		IndividualAck,
+		CumulativeAck
+	};
+
+	enum OutboundPolicy {
+		BlockWhenFull,
+		DropOldestWhenFull,
+		RejectWhenFull
+	};
+
 	void connectToHost(const QString &hostname, quint16 port = 61613);
+	// On Unix a socket the client created itself is written with gathering
+	// writes straight to its descriptor when it is a plain QTcpSocket with
+	// nothing queued. Its own bytesWritten() is not emitted for those bytes,
+	// socketBytesWritten() is. A socket given to setSocket() is always
+	// written through Qt.
 	void setSocket(QTcpSocket *socket);
 	QTcpSocket * socket() const;
 
-	void sendFrame(const QStompRequestFrame &frame);
+	// With the I/O thread enabled, connectToHost() runs the socket and the
+	// frame parser on a thread of their own, which hands complete frames to
+	// this thread in batches. The parser settings in effect when connecting
+	// are used for the whole connection, and socket() returns NULL; a socket
+	// given to setSocket() is always used from this thread. A CPU of -1
+	// leaves the I/O thread unpinned, pinning is supported on Linux only.
+	bool isIoThreadEnabled() const;
+	void setIoThreadEnabled(bool enabled);
+	int ioThreadCpu() const;
+	void setIoThreadCpu(int cpu);
+
+	bool sendFrame(const QStompRequestFrame &frame);
+	// Writes frames held back by coalescing right away. Frames are also
+	// written immediately when the client's thread runs no event loop.
+	void flush();
 
 	void login(const QByteArray &user = QByteArray(), const QByteArray &password = QByteArray());
 	void logout();
 
 	void send(const QByteArray &destination, const QString &body, const QByteArray &transactionId = QByteArray(), const QStompHeaderList &headers = QStompHeaderList());
+	// Sends the bytes as they are, shared rather than copied, and always with
+	// a content-length header
+	void sendBytes(const QByteArray &destination, const QByteArray &rawBody, const QByteArray &transactionId = QByteArray(), const QStompHeaderList &headers = QStompHeaderList());
 	void subscribe(const QByteArray &destination, bool autoAck, const QStompHeaderList &headers = QStompHeaderList());
 	void unsubscribe(const QByteArray &destination, const QStompHeaderList &headers = QStompHeaderList());
+	// Subscribes under a generated subscription id and returns it. MESSAGE
+	// frames of that subscription go straight to the handler, or to the
+	// receiver's member taking a const QStompResponseFrame &, and not to the
+	// frame buffer. A member with any other parameters is refused. The handler
+	// is called on the client's thread, the member on the receiver's. The
+	// client does not take ownership of the handler.
+	QByteArray subscribe(const QByteArray &destination, bool autoAck, QStompMessageHandler * handler, const QStompHeaderList &headers = QStompHeaderList());
+	QByteArray subscribe(const QByteArray &destination, bool autoAck, QObject * receiver, const char * member, const QStompHeaderList &headers = QStompHeaderList());
+	void unsubscribeId(const QByteArray &subscriptionId, const QStompHeaderList &headers = QStompHeaderList());
 	void commit(const QByteArray &transactionId, const QStompHeaderList &headers = QStompHeaderList());
 	void begin(const QByteArray &transactionId, const QStompHeaderList &headers = QStompHeaderList());
 	void abort(const QByteArray &transactionId, const QStompHeaderList &headers = QStompHeaderList());
 	void ack(const QByteArray &messageId, const QByteArray &transactionId = QByteArray(), const QStompHeaderList &headers = QStompHeaderList());
+	// Acknowledges a received message through the ack batcher
+	void ack(const QStompResponseFrame &message);
+	void flushAcks();
 
 	int framesAvailable() const;
 	QStompResponseFrame fetchFrame();
@@ -243,6 +322,110 @@ public:
 	void setContentEncoding(const QByteArray & name);
 	void setContentEncoding(const QTextCodec * codec);
 
+	// When enabled, header keys, values and bodies of received frames are
+	// views into a single copy of the frame. They stay valid only as long as
+	// a copy of the frame they came from is alive and its header is not
+	// modified.
+	bool isZeroCopyEnabled() const;
+	void setZeroCopyEnabled(bool enabled);
+
+	// When enabled, header keys and the values of destination, subscription,
+	// content-type, content-encoding and ack are shared between all received
+	// frames that carry the same bytes. Takes precedence over zero-copy mode.
+	bool isHeaderInterningEnabled() const;
+	void setHeaderInterningEnabled(bool enabled);
+
+	// Outgoing frames are collected and written together: at the end of the
+	// current event loop iteration (balanced), right away with Nagle's
+	// algorithm off (low latency) or after the coalescing delay with a larger
+	// send buffer (high throughput). Reaching the coalescing limit always
+	// forces a write.
+	TransferProfile transferProfile() const;
+	void setTransferProfile(TransferProfile profile);
+	int coalescingLimit() const;
+	void setCoalescingLimit(int bytes);
+	int coalescingDelay() const;
+	void setCoalescingDelay(int msecs);
+
+	// Once more than the high watermark is waiting to be written the client
+	// reports congestion and holds further frames back in its own queue,
+	// until less than the low watermark is left. That queue is bounded by
+	// the byte and frame limits, 16 MB and 16384 frames by default (0 means
+	// unbounded); the policy decides what happens to a frame that does not
+	// fit. Frames sent while the connection is still being set up wait in
+	// the same queue.
+	OutboundPolicy outboundPolicy() const;
+	void setOutboundPolicy(OutboundPolicy policy);
+	qint64 outboundByteLimit() const;
+	void setOutboundByteLimit(qint64 bytes);
+	int outboundFrameLimit() const;
+	void setOutboundFrameLimit(int frames);
+	qint64 outboundHighWatermark() const;
+	void setOutboundHighWatermark(qint64 bytes);
+	qint64 outboundLowWatermark() const;
+	void setOutboundLowWatermark(qint64 bytes);
+	qint64 outboundBytes() const;
+	bool isOutboundCongested() const;
+
+	// Once received frames waiting to be fetched plus unparsed input exceed
+	// the budget (0 means unlimited), the client stops reading from the
+	// socket and lets TCP push back on the broker. Reading resumes when
+	// fetching frames brings this below the low watermark. Frames larger than
+	// the maximum frame size (0 means unlimited) are skipped unread.
+	qint64 inboundBudget() const;
+	void setInboundBudget(qint64 bytes);
+	qint64 inboundLowWatermark() const;
+	void setInboundLowWatermark(qint64 bytes);
+	qint64 inboundBytes() const;
+	int maxFrameSize() const;
+	void setMaxFrameSize(int bytes);
+
+	// Sends the frame with an automatically assigned receipt id and tracks it
+	// until the broker confirms it. Returns the receipt id, or a null array if
+	// the frame was not sent because receiptWindow() frames are already
+	// unconfirmed; the receipts of batch commits do not count towards the
+	// window or receiptsPending(). The optional member is invoked as
+	// member(const QByteArray &receiptId, bool confirmed, qint64 roundTripUsecs)
+	// from the event loop once the RECEIPT (or an ERROR naming the receipt)
+	// arrives, the frame is dropped from a full backlog or the connection is
+	// lost. Tracked RECEIPT frames are not added to the frame buffer.
+	QByteArray sendConfirmed(const QStompRequestFrame &frame, QObject * receiver = 0, const char * member = 0);
+	int receiptWindow() const;
+	void setReceiptWindow(int frames);
+	int receiptsPending() const;
+
+	// Acks given as messages are collected per subscription and written
+	// together once ackBatchSize() are pending or ackBatchDelay() ms have
+	// passed since the first of them. In cumulative mode only the latest
+	// message of each subscription is acked, for brokers that treat a client
+	// ack as covering all earlier messages of the subscription. A message
+	// received before one already acked is not acked again.
+	AckMode ackMode() const;
+	void setAckMode(AckMode mode);
+	int ackBatchSize() const;
+	void setAckBatchSize(int acks);
+	int ackBatchDelay() const;
+	void setAckBatchDelay(int msecs);
+
+	// With transaction batching enabled, send() calls without a transaction
+	// id are grouped into generated transactions. A batch is committed after
+	// transactionBatchSize() sends, transactionBatchBytes() of body or
+	// transactionBatchDelay() ms, whichever comes first. If the broker reports
+	// an error or the connection drops before the commit is confirmed, the
+	// batch is aborted and sent again in a new transaction (after the next
+	// CONNECTED frame if need be), at most transactionReplayLimit() times.
+	bool isTransactionBatchingEnabled() const;
+	void setTransactionBatchingEnabled(bool enabled);
+	int transactionBatchSize() const;
+	void setTransactionBatchSize(int frames);
+	qint64 transactionBatchBytes() const;
+	void setTransactionBatchBytes(qint64 bytes);
+	int transactionBatchDelay() const;
+	void setTransactionBatchDelay(int msecs);
+	int transactionReplayLimit() const;
+	void setTransactionReplayLimit(int replays);
+	void commitBatch();
+
 public Q_SLOTS:
 	void disconnectFromHost();
 
@@ -251,12 +434,214 @@ Q_SIGNALS:
 	void socketDisconnected();
 	void socketError(QAbstractSocket::SocketError);
 	void socketStateChanged(QAbstractSocket::SocketState);
+	// Bytes the client wrote to the broker. Unlike the socket's own
+	// bytesWritten() this includes writes that bypass QTcpSocket.
+	void socketBytesWritten(qint64 bytes);
 
 	void frameReceived();
 
+	void outboundCongested();
+	void outboundDrained();
+
+	void receiptConfirmed(const QByteArray &receiptId, qint64 roundTripUsecs);
+	void receiptFailed(const QByteArray &receiptId);
+	void receiptWindowAvailable();
+
+	void batchCommitted(const QByteArray &transactionId, int frames);
+	void batchFailed(const QByteArray &transactionId, int frames);
+
+	// Frames queued by a QStompProducer that sendFrame() refused when the
+	// client got to them
+	void producerFramesRejected(int frames);
+
 private:
 	QStompClientPrivate * const pd_ptr;
 	Q_PRIVATE_SLOT(pd_func(), void _q_socketReadyRead());
+	Q_PRIVATE_SLOT(pd_func(), void _q_ioFramesReady());
+	Q_PRIVATE_SLOT(pd_func(), void _q_socketConnected());
+	Q_PRIVATE_SLOT(pd_func(), void _q_socketDisconnected());
+	Q_PRIVATE_SLOT(pd_func(), void _q_flushOutbound());
+	Q_PRIVATE_SLOT(pd_func(), void _q_socketBytesWritten(qint64));
+	Q_PRIVATE_SLOT(pd_func(), void _q_flushAcks());
+	Q_PRIVATE_SLOT(pd_func(), void _q_commitBatch());
+	Q_PRIVATE_SLOT(pd_func(), void _q_drainProducers());
+};
+
+// Sends to one destination with a fixed set of headers. The command line and
+// the static part of the header are serialized once, when the publisher is
+// created, using the client's content encoding at that time.
+class QSTOMP_SHARED_EXPORT QStompPublisher
+{
+	P_DECLARE_PRIVATE(QStompPublisher)
+public:
+	QStompPublisher(QStompClient * client, const QByteArray &destination, const QStompHeaderList &headers = QStompHeaderList());
+	~QStompPublisher();
+
+	QStompClient * client() const;
+	QByteArray destination() const;
+
+	bool send(const QString &body, const QByteArray &transactionId = QByteArray(), const QStompHeaderList &headers = QStompHeaderList());
+	bool sendBytes(const QByteArray &rawBody, const QByteArray &transactionId = QByteArray(), const QStompHeaderList &headers = QStompHeaderList());
+
+private:
+	Q_DISABLE_COPY(QStompPublisher)
+	QStompPublisherPrivate * const pd_ptr;
+};
+
+// Sends through a client from any thread. Frames are queued without taking a
+// lock and sent by the client's thread in batches, which is woken once per
+// batch instead of once per frame. Create the producer on the client's thread
+// and share it between the sending threads. Sends without a transaction id
+// take part in transaction batching like QStompClient::send(). Once the
+// client is gone, sending fails. A successful send only means the frame was
+// queued, frames the client refuses later are counted by its
+// producerFramesRejected() signal.
+class QSTOMP_SHARED_EXPORT QStompProducer
+{
+	P_DECLARE_PRIVATE(QStompProducer)
+public:
+	explicit QStompProducer(QStompClient * client);
+	~QStompProducer();
+
+	bool isOpen() const;
+
+	bool sendFrame(const QStompRequestFrame &frame);
+	bool send(const QByteArray &destination, const QString &body, const QByteArray &transactionId = QByteArray(), const QStompHeaderList &headers = QStompHeaderList());
+	bool sendBytes(const QByteArray &destination, const QByteArray &rawBody, const QByteArray &transactionId = QByteArray(), const QStompHeaderList &headers = QStompHeaderList());
+
+private:
+	Q_DISABLE_COPY(QStompProducer)
+	QStompProducerPrivate * const pd_ptr;
+};
+
+// Dispatches MESSAGE frames by destination. Destinations and patterns are
+// split into segments at '.' and '/'; in a pattern '*' matches exactly one
+// segment and '>' (as the last segment) one or more. Every handler with a
+// matching route is called once, even if several of its routes match, at a
+// cost that depends on the depth of the destination rather than on the
+// number of routes. Install it as the handler of a wildcard subscription.
+// Handlers are not owned by the router.
+class QSTOMP_SHARED_EXPORT QStompDestinationRouter : public QStompMessageHandler
+{
+	P_DECLARE_PRIVATE(QStompDestinationRouter)
+public:
+	QStompDestinationRouter();
+	~QStompDestinationRouter();
+
+	void addRoute(const QByteArray &pattern, QStompMessageHandler * handler);
+	void removeRoute(const QByteArray &pattern, QStompMessageHandler * handler);
+	void clear();
+	int routeCount() const;
+
+	QList<QStompMessageHandler *> match(const QByteArray &destination) const;
+	void handleMessage(const QStompResponseFrame &frame);
+
+private:
+	Q_DISABLE_COPY(QStompDestinationRouter)
+	QStompDestinationRouterPrivate * const pd_ptr;
+};
+
+// Spreads the traffic from one broker over several connections, each with a
+// QStompClient on a thread of its own. A subscription either goes to the
+// connection with the fewest subscriptions, or is made on every connection
+// so the broker balances the destination between them as competing
+// consumers. Messages from all connections go to one handler, which is
+// called on the thread of the connection that received the message and so
+// has to be thread-safe. Messages of subscriptions without auto ack are
+// acked once the handler returns. A connection subscribes again once the
+// broker accepts its login after a reconnect. A distributed destination is
+// only ever subscribed on one connection.
+class QSTOMP_SHARED_EXPORT QStompConsumerGroup : public QObject
+{
+	Q_OBJECT
+	P_DECLARE_PRIVATE(QStompConsumerGroup)
+public:
+	enum SubscriptionMode {
+		DistributeSubscriptions,
+		CompetingConsumers
+	};
+
+	struct Stats {
+		quint64 messages;
+		quint64 bytes;
+		quint64 errors;
+		int connected;
+	};
+
+	explicit QStompConsumerGroup(int connections, QObject *parent = 0);
+	virtual ~QStompConsumerGroup();
+
+	int connectionCount() const;
+	QStompMessageHandler * handler() const;
+	void setHandler(QStompMessageHandler * handler);
+
+	void connectToHost(const QString &hostname, quint16 port = 61613);
+	void login(const QByteArray &user = QByteArray(), const QByteArray &password = QByteArray());
+	void subscribe(const QByteArray &destination, SubscriptionMode mode = DistributeSubscriptions, bool autoAck = true, const QStompHeaderList &headers = QStompHeaderList());
+	void unsubscribe(const QByteArray &destination);
+
+	// Totals over all connections, or for one of them. Connected is the
+	// number of connections that are up.
+	Stats stats() const;
+	Stats stats(int connection) const;
+
+public Q_SLOTS:
+	void disconnectFromHost();
+
+Q_SIGNALS:
+	void connectionStateChanged(int connection, QAbstractSocket::SocketState state);
+	// The connection could not send the SUBSCRIBE frame, the destination is
+	// no longer subscribed there
+	void subscriptionFailed(int connection, const QByteArray &destination);
+
+private:
+	Q_DISABLE_COPY(QStompConsumerGroup)
+	QStompConsumerGroupPrivate * const pd_ptr;
+	Q_PRIVATE_SLOT(pd_func(), void _q_subscribeFailed(int, const QByteArray &));
+};
+
+// Runs a handler for received messages on a thread pool while keeping the
+// messages of each key in order. The key is the destination, or the value of
+// keyHeader() if one is set. Keys are hashed to a fixed number of lanes; a
+// lane runs one message at a time, different lanes run in parallel. Once
+// maxInFlight() messages are queued or running, handleMessage() blocks, which
+// stops the client from reading. When ack is enabled, messages are acked
+// after the handler returns from the thread the executor lives on, with the
+// acks of messages finished in the meantime going out together. The
+// executor has to live on the client's thread, and waitForDone() has to be
+// called there. In cumulative ack mode a message is only acked once every
+// earlier message of its subscription has finished as well. The thread pool
+// and the handler have to be set before the first message arrives.
+class QSTOMP_SHARED_EXPORT QStompOrderedExecutor : public QObject, public QStompMessageHandler
+{
+	Q_OBJECT
+	P_DECLARE_PRIVATE(QStompOrderedExecutor)
+public:
+	// Zero lanes picks four per core
+	QStompOrderedExecutor(QStompClient * client, QStompMessageHandler * handler, int lanes = 0, QObject *parent = 0);
+	virtual ~QStompOrderedExecutor();
+
+	QByteArray keyHeader() const;
+	void setKeyHeader(const QByteArray &name);
+	int maxInFlight() const;
+	void setMaxInFlight(int messages);
+	bool isAckEnabled() const;
+	void setAckEnabled(bool enabled);
+	QThreadPool * threadPool() const;
+	void setThreadPool(QThreadPool * pool);
+
+	int laneCount() const;
+	int inFlight() const;
+	// Waits for all queued messages to be handled and acked, -1 waits as
+	// long as it takes
+	bool waitForDone(int msecs = -1);
+
+	void handleMessage(const QStompResponseFrame &frame);
+
+private:
+	Q_DISABLE_COPY(QStompOrderedExecutor)
+	QStompOrderedExecutorPrivate * const pd_ptr;
+	Q_PRIVATE_SLOT(pd_func(), void _q_completed());
 };
 
 // Include private header so MOC won't complain
@@ -28,6 +28,13 @@
 	inline const Class##Private* pd_func() const { return reinterpret_cast<const Class##Private *>(this->pd_ptr); } \
 	friend class Class##Private;
 
+// Like P_DECLARE_PRIVATE, but for implicitly shared privates: non-const
+// access detaches first
+#define P_DECLARE_SHARED_PRIVATE(Class) \
+	inline Class##Private* pd_func() { this->detach(); return reinterpret_cast<Class##Private *>(this->pd_ptr); } \
+	inline const Class##Private* pd_func() const { return reinterpret_cast<const Class##Private *>(this->pd_ptr); } \
+	friend class Class##Private;
+
 #define P_DECLARE_PUBLIC(Class) \
 	inline Class* pq_func() { return static_cast<Class *>(this->pq_ptr); } \
 	inline const Class* pq_func() const { return static_cast<const Class *>(this->pq_ptr); } \
@@ -21,27 +21,469 @@
 #ifndef QSTOMP_P_H
 #define QSTOMP_P_H
 
+#include "qstomp.h"
+
 #include <QtCore/QObject>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QHash>
+#include <QtCore/QMap>
+#include <QtCore/QMetaMethod>
+#include <QtCore/QMutex>
+#include <QtCore/QPointer>
+#include <QtCore/QRunnable>
+#include <QtCore/QSemaphore>
+#include <QtCore/QSharedData>
+#include <QtCore/QVector>
+#include <QtCore/QSet>
+#include <QtCore/QVarLengthArray>
+#include <QtCore/QWaitCondition>
+
+class QIODevice;
+class QThread;
+class QTimer;
+
+static inline int qstompLoadAcquire(const QAtomicInt &value)
+{
+#if QT_VERSION >= 0x050000
+	return value.loadAcquire();
+#else
+	return const_cast<QAtomicInt &>(value).fetchAndAddAcquire(0);
+#endif
+}
+
+template <typename T>
+static inline T * qstompLoadAcquire(const QAtomicPointer<T> &value)
+{
+#if QT_VERSION >= 0x050000
+	return value.loadAcquire();
+#else
+	return const_cast<QAtomicPointer<T> &>(value).fetchAndAddAcquire(0);
+#endif
+}
+
+struct QStompHeaderSpan
+{
+	int keyPos;
+	int keyLength;
+	int valuePos;
+	int valueLength;
+};
+Q_DECLARE_TYPEINFO(QStompHeaderSpan, Q_PRIMITIVE_TYPE);
+
+struct QStompHeaderEntry
+{
+	int keyPos;
+	int keyLength;
+	int valuePos;
+	int valueLength;
+	uint keyHash;
+	int known;
+};
+Q_DECLARE_TYPEINFO(QStompHeaderEntry, Q_PRIMITIVE_TYPE);
 
-class QStompFramePrivate
+// All header keys and values of a frame packed into one byte arena, with
+// an entry per header holding offsets and the case-folded hash of its key.
+// The first occurrence of every well-known key is also kept in a fixed slot.
+// Negative offsets refer to implicitly shared strings (see
+// QStompInternTable) instead of the arena.
+class QStompHeaderTable
 {
 public:
-	QStompHeaderList m_header;
+	enum KnownHeader {
+		HeaderContentLength = 0,
+		HeaderContentType,
+		HeaderContentEncoding,
+		HeaderDestination,
+		HeaderSubscription,
+		HeaderMessageId,
+		HeaderReceiptId,
+		HeaderReceipt,
+		HeaderMessage,
+		HeaderTransaction,
+		HeaderAck,
+		HeaderId,
+		HeaderLogin,
+		HeaderPasscode,
+		KnownHeaderCount
+	};
+
+	QStompHeaderTable();
+
+	inline int size() const { return m_entries.size(); }
+	inline bool isEmpty() const { return m_entries.isEmpty(); }
+	inline void reserve(int size) { m_entries.reserve(size); }
+
+	inline const char * keyData(int i) const { return data(m_entries.at(i).keyPos); }
+	inline int keyLength(int i) const { return m_entries.at(i).keyLength; }
+	inline const char * valueData(int i) const { return data(m_entries.at(i).valuePos); }
+	inline int valueLength(int i) const { return m_entries.at(i).valueLength; }
+	inline int knownAt(int i) const { return m_entries.at(i).known; }
+	QByteArray keyAt(int i) const;
+	QByteArray valueAt(int i) const;
+
+	int indexOf(const char * key, int length, int from = 0) const;
+	inline int indexOf(const QByteArray &key, int from = 0) const { return indexOf(key.constData(), key.size(), from); }
+	inline int knownIndex(KnownHeader header) const { return m_known[header]; }
+	QByteArray value(KnownHeader header) const;
+	void setValue(KnownHeader header, const QByteArray &value);
+	inline uint contentLength() const { return m_contentLength; }
+
+	void append(const char * key, int keyLength, const char * value, int valueLength);
+	inline void append(const QByteArray &key, const QByteArray &value) { append(key.constData(), key.size(), value.constData(), value.size()); }
+	void appendSpan(const QStompHeaderSpan &span);
+	void appendShared(const QByteArray &key, const QByteArray &value);
+	void appendShared(const QByteArray &key, const char * value, int valueLength);
+	void setValueAt(int i, const QByteArray &value);
+	void removeAt(int i);
+	void clear();
+
+	void setSource(const QByteArray &data, bool views);
+
+	QStompHeaderList toList() const;
+	void setList(const QStompHeaderList &list);
+
+private:
+	inline const char * data(int pos) const { return pos >= 0 ? m_arena.constData() + pos : m_shared.at(-pos - 1).constData(); }
+	void appendEntry(const QStompHeaderEntry &e);
+	int share(const QByteArray &bytes);
+	void resetKnown();
+	void updateContentLength();
+	int store(const char * data, int length);
+	void squeezeIfWasteful();
+	void squeeze();
+
+	QByteArray m_arena;
+	QVector<QStompHeaderEntry> m_entries;
+	QVector<QByteArray> m_shared;
+	int m_known[KnownHeaderCount];
+	int m_garbage;
+	uint m_contentLength;
+	bool m_borrowed;
+	bool m_views;
+};
+
+class QStompFramePrivate : public QSharedData
+{
+public:
+	enum HeaderState {
+		HeaderParsed = 0,
+		HeaderPending,
+		HeaderParsing
+	};
+
+	virtual ~QStompFramePrivate() {}
+	virtual QStompFramePrivate * clone() const { return new QStompFramePrivate(*this); }
+
+	// Privates are recycled through a small per-thread pool
+	static void * operator new(size_t size);
+	static void operator delete(void * ptr, size_t size);
+	void copyFrameFrom(const QStompFramePrivate &other);
+
+	QByteArray m_raw;
+	mutable QStompHeaderTable m_header;
+	mutable QAtomicInt m_headerState;
+	int m_headerPos;
+	int m_headerLength;
+	bool m_headerViews;
 	bool m_valid;
 	QByteArray m_body;
 	const QTextCodec * m_textCodec;
+
+	// Received frames keep their header block untokenized in m_raw until
+	// the header is first looked at
+	inline void ensureHeader() const { if (qstompLoadAcquire(m_headerState) != HeaderParsed) parseHeader(); }
+	void parseHeader() const;
+
+	inline bool hasHeader(QStompHeaderTable::KnownHeader header) const { ensureHeader(); return m_header.knownIndex(header) != -1; }
+	inline QByteArray headerValue(QStompHeaderTable::KnownHeader header) const { ensureHeader(); return m_header.value(header); }
+	inline void setHeaderValue(QStompHeaderTable::KnownHeader header, const QByteArray &value) { ensureHeader(); m_header.setValue(header, value); }
+
+	// Appends the command line (if any) and the header block, including the
+	// empty line that ends it
+	void writeHead(QByteArray &out, const char * command, int commandLength) const;
 };
 
 class QStompResponseFramePrivate : public QStompFramePrivate
 {
 public:
+	QStompResponseFramePrivate() : m_sequence(0) {}
+	QStompFramePrivate * clone() const { return new QStompResponseFramePrivate(*this); }
+	static QStompResponseFramePrivate * sharedNull();
+
 	QStompResponseFrame::ResponseType m_type;
+	// Counts the MESSAGE frames a client received, 0 if not received
+	quint64 m_sequence;
+
+	static QStompResponseFramePrivate * get(QStompResponseFrame &frame) { return frame.pd_func(); }
+	static const QStompResponseFramePrivate * get(const QStompResponseFrame &frame) { return frame.pd_func(); }
 };
 
 class QStompRequestFramePrivate : public QStompFramePrivate
 {
 public:
+	QStompFramePrivate * clone() const { return new QStompRequestFramePrivate(*this); }
+	static QStompRequestFramePrivate * sharedNull();
+
 	QStompRequestFrame::RequestType m_type;
+
+	static const QStompRequestFramePrivate * get(const QStompRequestFrame &frame) { return frame.pd_func(); }
+};
+
+class QStompInternTable
+{
+public:
+	QByteArray intern(const char * data, int length);
+	void clear();
+
+private:
+	QSet<QByteArray> m_strings;
+};
+
+class QStompFrameParser
+{
+public:
+	enum State {
+		StateCommand,
+		StateHeaders,
+		StateBodyByLength,
+		StateBodyToNul,
+		StateSkipBytes,
+		StateSkipToNul
+	};
+
+	QStompFrameParser();
+
+	void readFrom(QIODevice * device);
+	bool takeFrame(QStompResponseFrame &frame);
+	void compact();
+
+	bool zeroCopy() const { return m_zeroCopy; }
+	void setZeroCopy(bool enabled) { m_zeroCopy = enabled; }
+	bool interning() const { return m_interning; }
+	void setInterning(bool enabled) { m_interning = enabled; if (!enabled) m_intern.clear(); }
+	int maxFrameSize() const { return m_maxFrameSize; }
+	void setMaxFrameSize(int bytes) { m_maxFrameSize = bytes; }
+
+	// Bytes read but not handed out as frames yet, and the size the last
+	// frame had on the wire
+	int bufferedBytes() const { return m_buffer.size() - m_offset; }
+	int lastFrameSize() const { return m_lastFrameSize; }
+
+private:
+	void resetFrame();
+	void resync(int to);
+	void dropFrame(qint64 length);
+	void scanHeaderLine(int start, int end);
+	void finishFrame(QStompResponseFrame &frame, int bodyLength, int end);
+	void internHeader(QStompFramePrivate * d);
+
+	QByteArray m_buffer;
+	int m_offset;
+	int m_scan;
+	State m_state;
+	bool m_zeroCopy;
+	bool m_interning;
+	QStompInternTable m_intern;
+
+	bool m_valid;
+	QStompResponseFrame::ResponseType m_type;
+	int m_headerStart;
+	int m_headerEnd;
+	int m_bodyStart;
+	qint64 m_contentLength;
+
+	int m_maxFrameSize;
+	int m_lastFrameSize;
+	qint64 m_skipRemaining;
+
+	int m_resyncCount;
+	qint64 m_skippedBytes;
+	int m_droppedCount;
+};
+
+// Hands frames from one producer thread to one consumer thread. Each side
+// only ever writes its own index, so neither needs a lock. Frames are swapped
+// in and out of the slots, the consumer's empty frame goes back to the
+// producer that way.
+class QStompFrameRing
+{
+public:
+	explicit QStompFrameRing(int capacity);
+	~QStompFrameRing();
+
+	// Producer side, leaves the frame alone if the ring is full
+	bool push(QStompResponseFrame &frame, int size);
+	// Consumer side
+	bool pop(QStompResponseFrame &frame, int &size);
+	bool isEmpty() const;
+
+private:
+	Q_DISABLE_COPY(QStompFrameRing)
+
+	struct Slot
+	{
+		QStompResponseFrame frame;
+		int size;
+	};
+
+	Slot * m_slots;
+	uint m_mask;
+	// Next slot to pop and next slot to push, counting up without wrapping
+	// to the capacity
+	QAtomicInt m_head;
+	QAtomicInt m_tail;
+};
+
+// Owns the socket and the parser of a client running in I/O thread mode.
+// Lives on the I/O thread, the client talks to it through queued calls and
+// the ring. Socket state, error and pending bytes are mirrored in atomics
+// for the client thread.
+class QStompIoWorker : public QObject
+{
+	Q_OBJECT
+public:
+	QStompIoWorker(QStompClient * client, int ringSize);
+
+	// Set up by the client before the I/O thread starts, only the I/O
+	// thread uses it after that
+	QStompFrameParser m_parser;
+
+	// Client thread side
+	QStompFrameRing m_ring;
+	QAtomicInt m_wakeup;
+	QAtomicInt m_stalled;
+	QAbstractSocket::SocketState state() const { return QAbstractSocket::SocketState(qstompLoadAcquire(this->m_state)); }
+	QAbstractSocket::SocketError error() const { return QAbstractSocket::SocketError(qstompLoadAcquire(this->m_error)); }
+	QString errorString() const;
+	qint64 bytesToWrite() const { return qstompLoadAcquire(this->m_queuedBytes) + qstompLoadAcquire(this->m_socketBytes); }
+	void beginConnect(const QString &hostname, quint16 port);
+	void post(const QVector<QByteArray> &segments, int bytes);
+	void resume();
+	// Counts socket progress (state changes, bytes written) so a blocked
+	// sender can wait for the next step
+	int progress() const;
+	bool waitForProgress(int progress, int msecs);
+
+public Q_SLOTS:
+	void connectToHost(const QString &hostname, quint16 port);
+	void disconnectFromHost();
+	void setSocketOptions(int lowDelay, int sendBuffer);
+	void pinToCpu(int cpu);
+	void readFrames();
+	void writePending();
+	void shutdown();
+
+Q_SIGNALS:
+	void connected();
+	void disconnected();
+	void stateChanged(QAbstractSocket::SocketState);
+	void error(QAbstractSocket::SocketError);
+	void bytesWritten(qint64);
+
+private Q_SLOTS:
+	void socketStateChanged(QAbstractSocket::SocketState state);
+	void socketError(QAbstractSocket::SocketError code);
+	void socketBytesWritten(qint64 bytes);
+
+private:
+	bool deliver(QStompResponseFrame &frame, int size);
+	void wakeClient();
+	void signalProgress();
+	void updateSocketBytes();
+
+	QStompClient * m_client;
+	QTcpSocket * m_socket;
+	// A parsed frame that did not fit into the ring
+	QStompResponseFrame m_held;
+	int m_heldSize;
+	bool m_holding;
+
+	QAtomicInt m_state;
+	QAtomicInt m_error;
+	QAtomicInt m_queuedBytes;
+	QAtomicInt m_socketBytes;
+	QAtomicInt m_writePending;
+	mutable QMutex m_mutex;
+	QWaitCondition m_progressed;
+	int m_progress;
+	QString m_errorString;
+	QVector<QByteArray> m_outbound;
+};
+
+struct QStompOutboundFrame
+{
+	QByteArray head;
+	QByteArray body;
+	// The receipt the frame asks for, failed if the frame is dropped
+	QByteArray receiptId;
+};
+
+struct QStompPendingReceipt
+{
+	QElapsedTimer timer;
+	QPointer<QObject> receiver;
+	QByteArray method;
+	// Set for the commit of a transaction batch
+	QByteArray transactionId;
+};
+
+struct QStompSubscription
+{
+	QStompSubscription() : handler(0) {}
+
+	QStompMessageHandler * handler;
+	QPointer<QObject> receiver;
+	QMetaMethod method;
+};
+
+struct QStompTransactionBatch
+{
+	QStompTransactionBatch() : bytes(0), replays(0) {}
+
+	QByteArray transactionId;
+	QList<QStompRequestFrame> frames;
+	qint64 bytes;
+	int replays;
+};
+
+struct QStompProducerNode
+{
+	QStompProducerNode * next;
+	QStompRequestFrame frame;
+	// Sent by send() without a transaction id
+	bool batchable;
+};
+
+// Frames queued by producers on any thread for the client's thread. Pushing
+// is a compare-and-swap onto a stack, the client takes the whole stack at
+// once and reverses it. Closing swaps a mark onto the stack, so every push
+// either lands before the close and is handed back by it, or fails. Shared
+// between the client and its producers so either may go first.
+class QStompProducerQueue : public QSharedData
+{
+public:
+	explicit QStompProducerQueue(QStompClient * client) : m_client(client) {}
+	~QStompProducerQueue();
+
+	// Any thread, fails once the queue is closed
+	bool push(QStompProducerNode * node);
+	bool isClosed() const { return qstompLoadAcquire(this->m_top) == closedMark(); }
+
+	// Client thread, nodes come out in the order they were pushed. close()
+	// returns what was still queued.
+	QStompProducerNode * takeAll();
+	QStompProducerNode * close();
+
+private:
+	Q_DISABLE_COPY(QStompProducerQueue)
+
+	static QStompProducerNode * closedMark();
+	static QStompProducerNode * reverse(QStompProducerNode * node);
+
+	QAtomicPointer<QStompProducerNode> m_top;
+	// Only taken to wake the client, NULL once closed
+	QMutex m_mutex;
+	QStompClient * m_client;
 };
 
 class QStompClientPrivate
@@ -53,14 +495,319 @@ public:
 	QTcpSocket * m_socket;
 	const QTextCodec * m_textCodec;
 
-	QByteArray m_buffer;
+	QStompFrameParser m_parser;
 	QList<QStompResponseFrame> m_framebuffer;
 
-	quint32 findMessageBytes();
+	// I/O thread mode, m_socket stays NULL while the worker owns the socket
+	bool m_ioEnabled;
+	int m_ioCpu;
+	QThread * m_ioThread;
+	QStompIoWorker * m_io;
+
+	// Reused for the command line and header block of every outgoing frame
+	QByteArray m_scratch;
+
+	QStompClient::TransferProfile m_profile;
+	int m_coalescingLimit;
+	int m_coalescingDelay;
+	QTimer * m_flushTimer;
+	// Segments waiting for the next flush. Small data is collected in the
+	// last segment while m_outboundTail is set, large bodies are kept by
+	// reference.
+	QVector<QByteArray> m_outbound;
+	bool m_outboundTail;
+	qint64 m_outboundBytes;
+
+	QStompClient::OutboundPolicy m_outboundPolicy;
+	qint64 m_outboundByteLimit;
+	int m_outboundFrameLimit;
+	qint64 m_highWatermark;
+	qint64 m_lowWatermark;
+	// Frames held back while congested or not yet connected
+	QList<QStompOutboundFrame> m_backlog;
+	qint64 m_backlogBytes;
+	bool m_congested;
+
+	qint64 m_inboundBudget;
+	qint64 m_inboundLowWatermark;
+	// Wire size of each frame in m_framebuffer, and their sum
+	QList<int> m_frameSizes;
+	qint64 m_framebufferBytes;
+	bool m_readPaused;
+
+	int m_receiptWindow;
+	quint64 m_receiptCounter;
+	QHash<QByteArray, QStompPendingReceipt> m_receipts;
+	// Commit receipts of transaction batches, not counted in the window
+	int m_batchReceipts;
+	bool m_receiptWindowFull;
+
+	QStompClient::AckMode m_ackMode;
+	int m_ackBatchSize;
+	int m_ackBatchDelay;
+	QTimer * m_ackTimer;
+	// Message ids waiting to be acked, per subscription
+	QHash<QByteArray, QList<QByteArray> > m_pendingAcks;
+	int m_pendingAckCount;
+	// The latest message acked in cumulative mode, per subscription
+	QHash<QByteArray, quint64> m_ackedSequences;
+	quint64 m_receiveSequence;
+
+	bool m_batching;
+	int m_batchSize;
+	qint64 m_batchBytes;
+	int m_batchDelay;
+	int m_replayLimit;
+	quint64 m_batchCounter;
+	QTimer * m_batchTimer;
+	QStompTransactionBatch m_openBatch;
+	// Batches whose COMMIT is not confirmed yet, and batches to send again
+	QList<QStompTransactionBatch> m_committing;
+	QList<QStompTransactionBatch> m_replay;
+
+	// Handlers of subscriptions made with a handler, by subscription id
+	QHash<QByteArray, QStompSubscription> m_subscriptions;
+	quint64 m_subscriptionCounter;
+
+	// Created with the first producer
+	QExplicitlySharedDataPointer<QStompProducerQueue> m_producerQueue;
+
+	void attachSocket();
+	void applySocketOptions();
+	void startIo();
+	void stopIo();
+	bool hasSocket() const { return this->m_socket != NULL || this->m_io != NULL; }
+	QAbstractSocket::SocketState socketState() const;
+	bool hasEventLoop() const;
+	bool writeFrame(const QStompRequestFramePrivate * frame);
+	bool writeSegments(const QByteArray &head, const QByteArray &body, const QByteArray &receiptId = QByteArray());
+	bool enqueueBacklog(const QByteArray &head, const QByteArray &body, const QByteArray &receiptId);
+	bool backlogFull(qint64 size) const;
+	void drainBacklog();
+	qint64 bytesInFlight() const;
+	void updateCongestion();
+	void queueOutbound(const QByteArray &head, const QByteArray &body);
+	void appendOutbound(const char * data, int length);
+	void flushOutbound();
+	bool isConnected() const;
+	qint64 inboundBytes() const;
+	void framesFetched();
+	bool handleReceipt(const QStompResponseFrame &frame);
+	void finishReceipt(const QByteArray &receiptId, bool confirmed);
+	void failAllReceipts();
+	void flushAcks();
+	void batchSend(QStompRequestFrame &frame);
+	void beginBatch();
+	void commitBatch();
+	void abortBatch();
+	void finishBatch(const QByteArray &transactionId, bool committed);
+	void failBatch(const QStompTransactionBatch &batch);
+	void replayBatches();
+	QByteArray subscribe(const QByteArray &destination, bool autoAck, const QStompSubscription &subscription, const QStompHeaderList &headers);
+	bool dispatchMessage(const QStompResponseFrame &frame);
+	bool deliverFrame(QStompResponseFrame &frame, int size);
 
 	void _q_socketReadyRead();
+	void _q_ioFramesReady();
+	void _q_socketConnected();
+	void _q_socketDisconnected();
+	void _q_flushOutbound() { flushOutbound(); drainBacklog(); }
+	void _q_socketBytesWritten(qint64);
+	void _q_flushAcks() { flushAcks(); }
+	void _q_commitBatch() { commitBatch(); }
+	void _q_drainProducers();
+	int sendProducerNodes(QStompProducerNode * node);
+
+	static QStompClientPrivate * get(QStompClient * client) { return client->pd_func(); }
 private:
 	QStompClient * const pq_ptr;
 };
 
+class QStompPublisherPrivate
+{
+public:
+	QPointer<QStompClient> m_client;
+	QByteArray m_destination;
+	const QTextCodec * m_textCodec;
+	// Command line and static header lines, without the closing empty line,
+	// for text and for raw bodies
+	QByteArray m_template;
+	QByteArray m_rawTemplate;
+	// The static headers, and every key the templates or the per-message
+	// lines already write, folded to lower case
+	QStompHeaderList m_headers;
+	QSet<QByteArray> m_templateKeys;
+
+	bool overridesTemplate(const QStompHeaderList &headers) const;
+	bool send(const QByteArray &body, bool withLength, const QByteArray &transactionId, const QStompHeaderList &headers);
+};
+
+class QStompProducerPrivate
+{
+public:
+	QExplicitlySharedDataPointer<QStompProducerQueue> m_queue;
+	const QTextCodec * m_textCodec;
+
+	bool enqueue(const QStompRequestFrame &frame, bool batchable);
+};
+
+class QStompRouteNode
+{
+public:
+	QStompRouteNode() : any(0) {}
+	~QStompRouteNode() { qDeleteAll(children); delete any; }
+
+	bool isEmpty() const { return children.isEmpty() && any == NULL && handlers.isEmpty() && tailHandlers.isEmpty(); }
+
+	QHash<QByteArray, QStompRouteNode *> children;
+	// The '*' child
+	QStompRouteNode * any;
+	// Routes ending at this node, and routes ending in '>' right below it
+	QList<QStompMessageHandler *> handlers;
+	QList<QStompMessageHandler *> tailHandlers;
+};
+
+class QStompDestinationRouterPrivate
+{
+public:
+	QStompDestinationRouterPrivate() : m_count(0) {}
+
+	QStompRouteNode m_root;
+	int m_count;
+
+	QList<QStompMessageHandler *> * routeList(const QByteArray &pattern, bool create);
+	bool removeRoute(QStompRouteNode * node, const QByteArray &pattern, int pos, QStompMessageHandler * handler);
+	void collect(const QByteArray &destination, QVarLengthArray<QStompMessageHandler *, 16> &out) const;
+};
+
+// One connection of a consumer group. Lives on the connection's thread
+// together with its client and is driven by the group through queued calls.
+struct QStompGroupSubscription
+{
+	bool autoAck;
+	QStompHeaderList headers;
+	// Null while the connection is down
+	QByteArray id;
+};
+
+class QStompGroupMember : public QObject, public QStompMessageHandler
+{
+	Q_OBJECT
+public:
+	QStompGroupMember(QStompConsumerGroupPrivate * group, int index);
+
+	QStompConsumerGroup::Stats stats() const;
+	void handleMessage(const QStompResponseFrame &frame);
+
+public Q_SLOTS:
+	void connectToHost(const QString &hostname, quint16 port);
+	void login(const QByteArray &user, const QByteArray &password);
+	void subscribe(const QByteArray &destination, bool autoAck, const QStompHeaderList &headers);
+	void unsubscribe(const QByteArray &destination);
+	void disconnectFromHost();
+	void shutdown();
+
+Q_SIGNALS:
+	void stateChanged(int connection, QAbstractSocket::SocketState state);
+	void subscribeFailed(int connection, const QByteArray &destination);
+
+private Q_SLOTS:
+	void clientStateChanged(QAbstractSocket::SocketState state);
+	void framesReceived();
+
+private:
+	bool subscribeOnClient(const QByteArray &destination, QStompGroupSubscription &subscription);
+	void resubscribe();
+
+	QStompConsumerGroupPrivate * const m_group;
+	const int m_index;
+	QStompClient * m_client;
+	// Subscriptions by destination, kept to be made again after a
+	// reconnect, and the ids that need acking
+	QHash<QByteArray, QStompGroupSubscription> m_subscriptions;
+	QSet<QByteArray> m_clientAck;
+
+	mutable QMutex m_mutex;
+	QStompConsumerGroup::Stats m_stats;
+};
+
+class QStompConsumerGroupPrivate
+{
+	P_DECLARE_PUBLIC(QStompConsumerGroup)
+public:
+	QStompConsumerGroupPrivate(QStompConsumerGroup * q) : pq_ptr(q) {}
+
+	void _q_subscribeFailed(int connection, const QByteArray &destination);
+
+	QAtomicPointer<QStompMessageHandler> m_handler;
+	QList<QThread *> m_threads;
+	QList<QStompGroupMember *> m_members;
+	// Connections each destination is subscribed on, and the number of
+	// subscriptions per connection
+	QHash<QByteArray, QList<int> > m_subscriptions;
+	QVector<int> m_load;
+
+private:
+	QStompConsumerGroup * const pq_ptr;
+};
+
+// Messages of one lane of an ordered executor. While running is set a task
+// owns the lane and works through the queue.
+class QStompExecutorLane
+{
+public:
+	QStompExecutorLane() : running(false) {}
+
+	QMutex mutex;
+	QList<QStompResponseFrame> queue;
+	bool running;
+};
+
+class QStompLaneTask : public QRunnable
+{
+public:
+	QStompLaneTask(QStompOrderedExecutorPrivate * executor, QStompExecutorLane * lane) : m_executor(executor), m_lane(lane) {}
+	void run();
+
+private:
+	QStompOrderedExecutorPrivate * const m_executor;
+	QStompExecutorLane * const m_lane;
+};
+
+class QStompOrderedExecutorPrivate
+{
+	P_DECLARE_PUBLIC(QStompOrderedExecutor)
+public:
+	QStompOrderedExecutorPrivate(QStompOrderedExecutor * q) : pq_ptr(q) {}
+
+	QPointer<QStompClient> m_client;
+	QStompMessageHandler * m_handler;
+	QByteArray m_keyHeader;
+	bool m_ackEnabled;
+	QThreadPool * m_pool;
+	QVector<QStompExecutorLane *> m_lanes;
+	// One permit per message that may be queued or running
+	int m_maxInFlight;
+	QSemaphore m_inFlight;
+	// Lane tasks started and not finished, they may still touch a lane
+	// after their last message is released
+	QMutex m_taskMutex;
+	QWaitCondition m_tasksDone;
+	int m_tasks;
+
+	// Messages handled on the pool and waiting for the client thread
+	QMutex m_completedMutex;
+	QList<QStompResponseFrame> m_completed;
+	// Messages handed out in cumulative ack mode by subscription, in the
+	// order received. A message still running holds an invalid frame.
+	QHash<QByteArray, QMap<quint64, QStompResponseFrame> > m_ackOrder;
+
+	void startTask(QStompExecutorLane * lane);
+	void finishTask();
+	void complete(const QStompResponseFrame &frame);
+	void _q_completed();
+private:
+	QStompOrderedExecutor * const pq_ptr;
+};
+
 #endif // QSTOMP_P_H